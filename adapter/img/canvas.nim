@@ -1,14 +1,20 @@
 # Very simple canvas renderer. At the moment, it uses an undocumented binary
-# protocol for reading commands, and renders it whenever stdin is closed.
-# So for now, it can only really render a single frame.
+# protocol for reading commands.
 #
-# It uses unifont for rendering text - currently I just store it as PNG
-# and read it with stbi. (TODO: try switching to a more efficient format
-# like qemacs fbf.)
+# "render" is the persistent renderer of a canvas. Its command stream is
+# split into frames by pcFrame; the bitmap is kept between frames, and at
+# the end of each one the damaged area is output as x, y, width and height
+# followed by the pixels of that area. The buffer assembles these into
+# complete frames.
+#
+# "decode" draws the commands until stdin is closed, and outputs the
+# result. It is used on the single-frame snapshots stored by the buffer.
+#
+# It uses unifont for rendering text, packed into a 1bpp glyph atlas at
+# build time by res/genunifont.nim.
 
 import std/os
 import std/posix
-import std/strutils
 
 import img/bitmap
 import img/painter
@@ -19,30 +25,124 @@ import types/color
 import types/line
 import utils/sandbox
 
-{.compile: "canvas.c".}
+type Damage = object
+  x1, y1, x2, y2: int
+
+func isEmpty(damage: Damage): bool =
+  return damage.x1 >= damage.x2 or damage.y1 >= damage.y2
+
+# Add the (exclusive) box x1, y1, x2, y2 to the damage, clamped to bmp.
+proc add(damage: var Damage; bmp: Bitmap; x1, y1, x2, y2: int) =
+  let x1 = max(x1, 0)
+  let y1 = max(y1, 0)
+  let x2 = min(x2, bmp.width)
+  let y2 = min(y2, bmp.height)
+  if x1 >= x2 or y1 >= y2:
+    return
+  if damage.isEmpty:
+    damage = Damage(x1: x1, y1: y1, x2: x2, y2: y2)
+  else:
+    damage.x1 = min(damage.x1, x1)
+    damage.y1 = min(damage.y1, y1)
+    damage.x2 = max(damage.x2, x2)
+    damage.y2 = max(damage.y2, y2)
 
-{.passc: "-I" & currentSourcePath().parentDir().}
+proc add(damage: var Damage; bmp: Bitmap; lines: openArray[Line]) =
+  for line in lines:
+    damage.add(bmp, int(line.minx), int(line.miny), int(line.maxx) + 1,
+      int(line.maxy) + 1)
 
-{.push header: "stb_image.h".}
-proc stbi_load_from_memory(buffer: ptr uint8; len: cint; x, y, comp: ptr cint;
-  req_comp: cint): ptr uint8
-proc stbi_image_free(retval_from_stbi_load: pointer)
-{.pop.}
+# Output the damaged area of bmp.
+proc sendDamage(os: PosixStream; bmp: Bitmap; damage: Damage) =
+  if damage.isEmpty:
+    return
+  let w = damage.x2 - damage.x1
+  var rect = [damage.x1, damage.y1, w, damage.y2 - damage.y1]
+  os.sendDataLoop(addr rect[0], sizeof(rect))
+  for y in damage.y1 ..< damage.y2:
+    let i = y * bmp.width + damage.x1
+    os.sendDataLoop(addr bmp.px[i], w * sizeof(bmp.px[0]))
 
-const unifont = readFile"res/unifont_jp-15.0.05.png"
-proc loadUnifont(unifont: string): ImageBitmap =
-  var width, height, comp: cint
-  let p = stbi_load_from_memory(cast[ptr uint8](unsafeAddr unifont[0]),
-    cint(unifont.len), addr width, addr height, addr comp, 4)
-  let len = width * height
-  let bitmap = ImageBitmap(
-    px: cast[seq[RGBAColorBE]](newSeqUninitialized[uint32](len)),
-    width: int(width),
-    height: int(height)
-  )
-  copyMem(addr bitmap.px[0], p, len)
-  stbi_image_free(p)
-  return bitmap
+proc paint(bmp: Bitmap; r: var BufferedReader; cmd: PaintCommand;
+    damage: var Damage) =
+  case cmd
+  of pcSetDimensions, pcFrame: discard
+  of pcDrawImage:
+    # w * h pixels, composited onto the bitmap at x, y
+    var x, y, w, h: int
+    r.sread(x)
+    r.sread(y)
+    r.sread(w)
+    r.sread(h)
+    if w <= 0 or h <= 0 or w > bmp.width or h > bmp.height:
+      return
+    let src = newBitmap(w, h)
+    r.readData(addr src.px[0], src.px.len * sizeof(src.px[0]))
+    for i in 0 ..< h:
+      bmp.blendSpan(x, y + i, src, 0, i, w)
+    damage.add(bmp, x, y, x + w, y + h)
+  of pcClearRect:
+    var x1, y1, x2, y2: int
+    r.sread(x1)
+    r.sread(y1)
+    r.sread(x2)
+    r.sread(y2)
+    bmp.clearRect(x1, y1, x2, y2)
+    damage.add(bmp, x1, y1, x2, y2)
+  of pcFillRect, pcStrokeRect:
+    var x1, y1, x2, y2: int
+    var color: ARGBColor
+    r.sread(x1)
+    r.sread(y1)
+    r.sread(x2)
+    r.sread(y2)
+    r.sread(color)
+    if cmd == pcFillRect:
+      bmp.fillRect(x1, y1, x2, y2, color)
+      damage.add(bmp, x1, y1, x2, y2)
+    else:
+      bmp.strokeRect(x1, y1, x2, y2, color)
+      damage.add(bmp, x1, y1, x2 + 1, y2 + 1)
+  of pcFillPath:
+    var lines: PathLines
+    var color: ARGBColor
+    var fillRule: CanvasFillRule
+    r.sread(lines)
+    r.sread(color)
+    r.sread(fillRule)
+    bmp.fillPath(lines, color, fillRule)
+    var minx = float64(bmp.width)
+    var maxx = 0f64
+    for i in 0 ..< lines.len:
+      let it = lines[i]
+      minx = min(minx, min(it.p0.x, it.p1.x))
+      maxx = max(maxx, max(it.p0.x, it.p1.x))
+    damage.add(bmp, int(minx), int(lines.miny), int(maxx) + 1,
+      int(lines.maxy) + 1)
+  of pcStrokePath:
+    var lines: seq[Line]
+    var color: ARGBColor
+    r.sread(lines)
+    r.sread(color)
+    bmp.strokePath(lines, color)
+    damage.add(bmp, lines)
+  of pcFillText, pcStrokeText:
+    var text: string
+    var x, y: float64
+    var color: ARGBColor
+    var align: CanvasTextAlign
+    r.sread(text)
+    r.sread(x)
+    r.sread(y)
+    r.sread(color)
+    r.sread(align)
+    if cmd == pcFillText:
+      bmp.fillText(text, x, y, color, align)
+    else:
+      bmp.strokeText(text, x, y, color, align)
+    # glyphs are 16px high and drawn from y - 8; the horizontal extent
+    # depends on the alignment, so just damage the whole band.
+    damage.add(bmp, 0, int(y) - 8, bmp.width, int(y) + 8)
 
 proc main() =
   enterNetworkSandbox()
@@ -51,23 +151,9 @@ proc main() =
   if getEnv("MAPPED_URI_SCHEME") != "img-codec+x-cha-canvas":
     os.write("Cha-Control: ConnectionError 1 wrong scheme\n")
     quit(1)
-  case getEnv("MAPPED_URI_PATH")
-  of "decode":
-    let headers = getEnv("REQUEST_HEADERS")
-    for hdr in headers.split('\n'):
-      if hdr.strip() == "Cha-Image-Info-Only: 1":
-        #TODO this is a hack...
-        # basically, we eat & discard all data from the buffer so it gets saved
-        # to a cache file. then, actually render when the pager asks us to
-        # do so.
-        # obviously this is highly sub-optimal; a better solution would be to
-        # leave stdin open & pass down the stream id from the buffer. (but then
-        # you have to save canvas output too, so it doesn't have to be
-        # re-coded, and handle that case in encoders... or implement on-demand
-        # multi-frame output.)
-        os.write("\n")
-        discard ps.recvAll()
-        quit(0)
+  let path = getEnv("MAPPED_URI_PATH")
+  case path
+  of "decode", "render":
     var cmd: PaintCommand
     var width: int
     var height: int
@@ -79,7 +165,9 @@ proc main() =
       r.sread(width)
       r.sread(height)
     os.write("Cha-Image-Dimensions: " & $width & "x" & $height & "\n\n")
+    let render = path == "render"
     let bmp = newBitmap(width, height)
+    var damage = Damage()
     var alive = true
     while alive:
       try:
@@ -88,51 +176,16 @@ proc main() =
           case cmd
           of pcSetDimensions:
             alive = false
-          of pcFillRect, pcStrokeRect:
-            var x1, y1, x2, y2: int
-            var color: ARGBColor
-            r.sread(x1)
-            r.sread(y1)
-            r.sread(x2)
-            r.sread(y2)
-            r.sread(color)
-            if cmd == pcFillRect:
-              bmp.fillRect(x1, y1, x2, y2, color)
-            else:
-              bmp.strokeRect(x1, y1, x2, y2, color)
-          of pcFillPath:
-            var lines: PathLines
-            var color: ARGBColor
-            var fillRule: CanvasFillRule
-            r.sread(lines)
-            r.sread(color)
-            r.sread(fillRule)
-            bmp.fillPath(lines, color, fillRule)
-          of pcStrokePath:
-            var lines: seq[Line]
-            var color: ARGBColor
-            r.sread(lines)
-            r.sread(color)
-            bmp.strokePath(lines, color)
-          of pcFillText, pcStrokeText:
-            if unifontBitmap == nil:
-              unifontBitmap = loadUnifont(unifont)
-            var text: string
-            var x, y: float64
-            var color: ARGBColor
-            var align: CanvasTextAlign
-            r.sread(text)
-            r.sread(x)
-            r.sread(y)
-            r.sread(color)
-            r.sread(align)
-            if cmd == pcFillText:
-              bmp.fillText(text, x, y, color, align)
-            else:
-              bmp.strokeText(text, x, y, color, align)
+          of pcFrame:
+            if render:
+              os.sendDamage(bmp, damage)
+              damage = Damage()
+          else:
+            bmp.paint(r, cmd, damage)
       except EOFError, ErrorConnectionReset, ErrorBrokenPipe:
         break
-    os.sendDataLoop(addr bmp.px[0], bmp.px.len * sizeof(bmp.px[0]))
+    if not render:
+      os.sendDataLoop(addr bmp.px[0], bmp.px.len * sizeof(bmp.px[0]))
   of "encode":
     os.write("Cha-Control: ConnectionError 1 not supported\n")
     quit(1)
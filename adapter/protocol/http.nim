@@ -162,5 +162,8 @@ proc main() =
     puts(getCurlConnectionError(res))
     op.connectreport = true
   curl_easy_cleanup(curl)
+  if res != CURLE_OK:
+    # tell the loader the body is incomplete, so that it is not cached
+    quit(1)
 
 main()
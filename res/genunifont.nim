@@ -0,0 +1,83 @@
+# Convert the unifont PNG into a packed 1bpp glyph atlas.
+#
+# Output format (all integers are little-endian):
+# * width bitmap: 8192 bytes; bit (u and 7) of byte (u shr 3) is set if
+#   code point u is full width (16x16), otherwise it is half width (8x16).
+# * group offsets: 8192 uint32s; the offset of the first glyph of each
+#   group of 8 code points, relative to the start of the glyph data.
+# * glyph data: 16 rows per glyph, 1 byte per row for half width glyphs
+#   and 2 bytes per row for full width ones. The most significant bit is
+#   the leftmost pixel, and a set bit means the pixel is painted.
+#
+# So the glyph of u is found at groupOffsets[u shr 3] + 16 * (u and 7) +
+# 16 * popcount(widthBitmap[u shr 3] and ((1 shl (u and 7)) - 1)).
+
+import std/os
+
+{.compile: "genunifont.c".}
+
+{.passc: "-I" & currentSourcePath().parentDir() / ".." / "adapter" / "img".}
+
+{.push header: "stb_image.h".}
+proc stbi_load_from_memory(buffer: ptr uint8; len: cint; x, y, comp: ptr cint;
+  req_comp: cint): ptr UncheckedArray[uint8]
+proc stbi_image_free(retval_from_stbi_load: pointer)
+{.pop.}
+
+const InputPath = "res/unifont_jp-15.0.05.png"
+
+proc putU32(s: var string; n: uint32) =
+  s &= char(n and 0xFF)
+  s &= char((n shr 8) and 0xFF)
+  s &= char((n shr 16) and 0xFF)
+  s &= char(n shr 24)
+
+proc main() =
+  var f: File
+  if not open(f, InputPath):
+    stderr.write(InputPath & " not found\n")
+    quit(1)
+  let png = f.readAll()
+  f.close()
+  var width, height, comp: cint
+  let p = stbi_load_from_memory(cast[ptr uint8](unsafeAddr png[0]),
+    cint(png.len), addr width, addr height, addr comp, 1)
+  if p == nil or width != 32 + 16 * 256 or height != 64 + 16 * 256:
+    stderr.write("unexpected unifont image\n")
+    quit(1)
+  # Unifont glyphs start at x: 32, y: 64, and are of 8x16/16x16 size.
+  # Everything that is not white is painted.
+  template ink(u, x, y: int): bool =
+    let gx = 32 + 16 * (u mod 0x100) + x
+    let gy = 64 + 16 * (u div 0x100) + y
+    p[gy * int(width) + gx] != 255
+  var widths = newString(0x10000 div 8)
+  var offsets = ""
+  var data = ""
+  for u in 0 ..< 0x10000:
+    if u mod 8 == 0:
+      offsets.putU32(uint32(data.len))
+    var fullwidth = false
+    block loop:
+      # hack to recognize full width characters
+      for y in 0 ..< 16:
+        for x in 8 ..< 16:
+          if ink(u, x, y):
+            fullwidth = true
+            break loop
+    if fullwidth:
+      widths[u shr 3] = char(uint8(widths[u shr 3]) or (1u8 shl (u and 7)))
+    let bw = if fullwidth: 2 else: 1
+    for y in 0 ..< 16:
+      for i in 0 ..< bw:
+        var b = 0u8
+        for x in 0 ..< 8:
+          if ink(u, i * 8 + x, y):
+            b = b or (0x80u8 shr x)
+        data &= char(b)
+  stbi_image_free(p)
+  stdout.write(widths)
+  stdout.write(offsets)
+  stdout.write(data)
+
+main()
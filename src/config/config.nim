@@ -121,6 +121,9 @@ type
     prepend_scheme* {.jsgetset.}: string
     proxy* {.jsgetset.}: URL
     default_headers* {.jsgetset.}: Table[string, string]
+    cache_dir* {.jsgetset.}: ChaPathResolved
+    cache_size* {.jsgetset.}: int32
+    memory_cache_size* {.jsgetset.}: int32
 
   DisplayConfig = object
     color_mode* {.jsgetset.}: Option[ColorMode]
@@ -157,6 +160,7 @@ type
     referer_from* {.jsgetset.}: bool
     autofocus* {.jsgetset.}: bool
     meta_refresh* {.jsgetset.}: MetaRefresh
+    max_render_rate* {.jsgetset.}: int32
 
   Config* = ref object
     jsctx: JSContext
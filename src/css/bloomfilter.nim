@@ -0,0 +1,55 @@
+# Counting Bloom filter of the tag names, IDs and classes of an element's
+# ancestors.
+#
+# The cascade keeps one of these for the chain of ancestors of the element
+# being styled, and uses it to reject selectors whose descendant/child
+# compounds need an ancestor that is definitely not there - without walking
+# up the tree. (Same idea as WebKit's SelectorFilter.)
+#
+# Counters saturate at 255; saturated counters are never decremented, so
+# the filter may only get more permissive than it should be, never less.
+
+import html/catom
+
+const
+  AncestorFilterBits = 12
+  AncestorFilterSize = 1 shl AncestorFilterBits
+  AncestorFilterMask = AncestorFilterSize - 1
+
+type
+  AncestorHashKind* = enum
+    ahkTag, ahkId, ahkClass
+
+  AncestorFilter* = object
+    counters: array[AncestorFilterSize, uint8]
+
+# Mix the atom with its kind, so that e.g. the tag "foo" and the class "foo"
+# get different hashes.
+func ancestorHash*(atom: CAtom; kind: AncestorHashKind): uint32 =
+  var h = uint32(int(atom) and 0xFFFFFFFF) * 3 + uint32(kind)
+  # murmur3 finalizer
+  h = h xor (h shr 16)
+  h *= 0x85EBCA6Bu32
+  h = h xor (h shr 13)
+  h *= 0xC2B2AE35u32
+  h = h xor (h shr 16)
+  return h
+
+template index1(h: uint32): int = int(h and AncestorFilterMask)
+template index2(h: uint32): int =
+  int((h shr AncestorFilterBits) and AncestorFilterMask)
+
+proc add*(filter: var AncestorFilter; h: uint32) =
+  for i in [index1(h), index2(h)]:
+    if filter.counters[i] < uint8.high:
+      inc filter.counters[i]
+
+proc remove*(filter: var AncestorFilter; h: uint32) =
+  for i in [index1(h), index2(h)]:
+    # saturated counters must stay saturated
+    if filter.counters[i] < uint8.high:
+      dec filter.counters[i]
+
+# False means the hash was definitely never added.
+func mayContain*(filter: AncestorFilter; h: uint32): bool =
+  return filter.counters[index1(h)] != 0 and filter.counters[index2(h)] != 0
@@ -1,8 +1,8 @@
-import std/algorithm
 import std/options
 import std/tables
 
 import chame/tags
+import css/bloomfilter
 import css/cssparser
 import css/cssvalues
 import css/match
@@ -25,6 +25,9 @@ type
     ua: RuleList # user agent
     user: RuleList
     author: seq[RuleList]
+    # True if no candidate rule depended on anything but the element's tag,
+    # ID, classes, attributes and ancestors.
+    shareable: bool
 
 func appliesLR(feature: MediaFeature; window: Window; n: LayoutUnit): bool =
   let a = feature.lengthrange.s.a.px(window.attrs, 0)
@@ -79,50 +82,94 @@ func applies*(mqlist: MediaQueryList; window: Window): bool =
 appliesFwdDecl = applies
 
 type
-  ToSorts = array[PseudoElem, seq[(int, CSSRuleDef)]]
+  # Candidates from one lookup table entry, and the next one to check.
+  RuleBucket = object
+    sels: ptr seq[CSSRuleSelector]
+    i: int
+
+  # Ancestors of the element currently being styled, and a Bloom filter of
+  # their tags/IDs/classes.
+  AncestorStack = object
+    filter: AncestorFilter
+    elements: seq[StyledNode]
+
+iterator ancestorHashes(element: Element): uint32 =
+  yield element.localName.ancestorHash(ahkTag)
+  if element.id != CAtomNull:
+    yield element.id.ancestorHash(ahkId)
+  for class in element.classList.toks:
+    yield class.ancestorHash(ahkClass)
+
+proc push(ancestors: var AncestorStack; styledNode: StyledNode) =
+  for h in Element(styledNode.node).ancestorHashes:
+    ancestors.filter.add(h)
+  ancestors.elements.add(styledNode)
+
+proc pop(ancestors: var AncestorStack) =
+  let styledNode = ancestors.elements.pop()
+  for h in Element(styledNode.node).ancestorHashes:
+    ancestors.filter.remove(h)
+
+# Pop ancestors until the top is styledParent.
+proc popUntil(ancestors: var AncestorStack; styledParent: StyledNode) =
+  while ancestors.elements.len > 0 and ancestors.elements[^1] != styledParent:
+    ancestors.pop()
+
+func mayMatch(filter: AncestorFilter; hashes: seq[uint32]): bool =
+  for h in hashes:
+    if not filter.mayContain(h):
+      return false
+  return true
 
-proc calcRule(tosorts: var ToSorts; styledNode: StyledNode; rule: CSSRuleDef) =
-  for sel in rule.sels:
+proc calcRule(res: var RuleList; styledNode: StyledNode; it: CSSRuleSelector;
+    filter: AncestorFilter; shareable: var bool) =
+  let rule = it.rule
+  if filter.mayMatch(rule.ancestorHashes[it.sel]):
+    shareable = shareable and rule.shareable
+    let sel = rule.sels[it.sel]
     if styledNode.selectorsMatch(sel):
-      let spec = getSpecificity(sel)
-      tosorts[sel.pseudo].add((spec, rule))
-
-func calcRules(styledNode: StyledNode; sheet: CSSStylesheet): RuleList =
-  var tosorts: ToSorts
+      res[sel.pseudo].add(rule)
+
+# Lookup tables are sorted by rank, so we get the matching rules in cascade
+# order by merging the candidate lists.  (There are only a few, so a
+# linear scan for the lowest rank is good enough.)
+# buckets is a scratch buffer, reused between elements.
+proc calcRules(styledNode: StyledNode; sheet: CSSStylesheet;
+    filter: AncestorFilter; shareable: var bool;
+    buckets: var seq[RuleBucket]): RuleList =
+  template addBucket(p: ptr seq[CSSRuleSelector]) =
+    if p[].len > 0:
+      buckets.add(RuleBucket(sels: p))
   let element = Element(styledNode.node)
-  var rules: seq[CSSRuleDef] = @[]
+  buckets.setLen(0)
   sheet.tagTable.withValue(element.localName, v):
-    for rule in v[]:
-      rules.add(rule)
+    addBucket(v)
   if element.id != CAtomNull:
     sheet.idTable.withValue(element.id, v):
-      for rule in v[]:
-        rules.add(rule)
+      addBucket(v)
   for class in element.classList.toks:
     sheet.classTable.withValue(class, v):
-      for rule in v[]:
-        rules.add(rule)
+      addBucket(v)
   for attr in element.attrs:
     sheet.attrTable.withValue(attr.qualifiedName, v):
-      for rule in v[]:
-        rules.add(rule)
-  for rule in sheet.generalList:
-    rules.add(rule)
-  rules.sort(ruleDefCmp, order = Ascending)
-  for rule in rules:
-    tosorts.calcRule(styledNode, rule)
-  for i in PseudoElem:
-    tosorts[i].sort((proc(x, y: (int, CSSRuleDef)): int =
-      cmp(x[0], y[0])
-    ), order = Ascending)
-    result[i] = newSeqOfCap[CSSRuleDef](tosorts[i].len)
-    for item in tosorts[i]:
-      result[i].add(item[1])
+      addBucket(v)
+  addBucket(addr sheet.generalList)
+  while buckets.len > 0:
+    var k = 0
+    for j in 1 ..< buckets.len:
+      if buckets[j].sels[][buckets[j].i].rank <
+          buckets[k].sels[][buckets[k].i].rank:
+        k = j
+    let it = buckets[k].sels[][buckets[k].i]
+    inc buckets[k].i
+    if buckets[k].i >= buckets[k].sels[].len:
+      buckets.del(k)
+    result.calcRule(styledNode, it, filter, shareable)
 
 func calcPresentationalHints(element: Element): CSSComputedValues =
   template set_cv(a, b: untyped) =
     if result == nil:
-      new(result)
+      result = newCSSComputedValues()
     result{a} = b
   template map_width =
     let s = parseDimensionValues(element.attr(satWidth))
@@ -228,7 +275,7 @@ type
 
 func buildComputedValues(rules: CSSValueEntryMap; presHints, parent:
     CSSComputedValues): CSSComputedValues =
-  new(result)
+  result = newCSSComputedValues()
   var previousOrigins: array[CSSOrigin, CSSComputedValues]
   for entry in rules[coUserAgent].normal: # user agent
     result.applyValue(entry, parent, nil)
@@ -274,7 +321,7 @@ proc add(map: var CSSValueEntryObj; rules: seq[CSSRuleDef]) =
     map.important.add(rule.importantVals)
 
 proc applyDeclarations(styledNode: StyledNode; parent: CSSComputedValues;
-    map: RuleListMap) =
+    map: RuleListMap; interner: var CSSValuesInterner) =
   var rules: CSSValueEntryMap
   var presHints: CSSComputedValues = nil
   rules[coUserAgent].add(map.ua[peNone])
@@ -293,6 +340,7 @@ proc applyDeclarations(styledNode: StyledNode; parent: CSSComputedValues;
           rules[coAuthor].normal.add(vals)
     presHints = element.calcPresentationalHints()
   styledNode.computed = rules.buildComputedValues(presHints, parent)
+  interner.intern(styledNode.computed)
 
 func hasValues(rules: CSSValueEntryMap): bool =
   for origin in CSSOrigin:
@@ -302,7 +350,7 @@ func hasValues(rules: CSSValueEntryMap): bool =
 
 # Either returns a new styled node or nil.
 proc applyDeclarations(pseudo: PseudoElem; styledParent: StyledNode;
-    map: RuleListMap): StyledNode =
+    map: RuleListMap; interner: var CSSValuesInterner): StyledNode =
   var rules: CSSValueEntryMap
   rules[coUserAgent].add(map.ua[pseudo])
   rules[coUser].add(map.user[pseudo])
@@ -310,6 +358,7 @@ proc applyDeclarations(pseudo: PseudoElem; styledParent: StyledNode;
     rules[coAuthor].add(rule[pseudo])
   if rules.hasValues():
     let cvals = rules.buildComputedValues(nil, styledParent.computed)
+    interner.intern(cvals)
     return styledParent.newStyledElement(pseudo, cvals)
   return nil
 
@@ -323,35 +372,103 @@ func applyMediaQuery(ss: CSSStylesheet; window: Window): CSSStylesheet =
       res.add(mq.children.applyMediaQuery(window))
   return res
 
-func calcRules(styledNode: StyledNode; ua, user: CSSStylesheet;
-    author: seq[CSSStylesheet]): RuleListMap =
-  let uadecls = calcRules(styledNode, ua)
+proc calcRules(styledNode: StyledNode; ua, user: CSSStylesheet;
+    author: seq[CSSStylesheet]; filter: AncestorFilter;
+    buckets: var seq[RuleBucket]): RuleListMap =
+  var shareable = true
+  let uadecls = calcRules(styledNode, ua, filter, shareable, buckets)
   var userdecls: RuleList
   if user != nil:
-    userdecls = calcRules(styledNode, user)
+    userdecls = calcRules(styledNode, user, filter, shareable, buckets)
   var authordecls: seq[RuleList]
   for rule in author:
-    authordecls.add(calcRules(styledNode, rule))
+    authordecls.add(calcRules(styledNode, rule, filter, shareable, buckets))
   return RuleListMap(
     ua: uadecls,
     user: userdecls,
-    author: authordecls
+    author: authordecls,
+    shareable: shareable
   )
 
-proc applyStyle(parent, styledNode: StyledNode; map: RuleListMap) =
+proc applyStyle(parent, styledNode: StyledNode; map: RuleListMap;
+    interner: var CSSValuesInterner) =
   let parentComputed = if parent != nil:
     parent.computed
   else:
     rootProperties()
-  styledNode.applyDeclarations(parentComputed, map)
+  styledNode.applyDeclarations(parentComputed, map, interner)
+
+# Style sharing cache: siblings with the same tag, classes and attributes
+# (think table rows, list items) usually end up with the same style, so
+# we remember the last few elements whose rules were shareable, and copy
+# the computed values of a matching one instead of running the cascade.
+#
+# Pseudo-class state needs no key: if any candidate rule could depend on
+# it, the element is not shareable in the first place.  Dependencies on
+# ancestors (e.g. "div:hover p") are copied along, so the existing
+# invalidation mechanism still works for elements that share.
+const StyleSharingCacheSize = 16
+
+type
+  StyleSharingEntry = object
+    styledNode: StyledNode
+    declmap: RuleListMap
+
+  StyleSharingCache = object
+    entries: seq[StyleSharingEntry]
 
-type CascadeFrame = object
-  styledParent: StyledNode
-  child: Node
-  pseudo: PseudoElem
-  cachedChild: StyledNode
-  cachedChildren: seq[StyledNode]
-  parentDeclMap: RuleListMap
+func sameAttrs(a, b: Element): bool =
+  if a.attrs.len != b.attrs.len:
+    return false
+  for i in 0 ..< a.attrs.len:
+    let aa = a.attrs[i]
+    let ba = b.attrs[i]
+    if aa.qualifiedName != ba.qualifiedName or
+        aa.namespace != ba.namespace or aa.value != ba.value:
+      return false
+  return true
+
+func canShareWith(element, other: Element): bool =
+  # IDs are unique anyway, and inline style may have been set from JS
+  # without touching the attribute.
+  return element.localName == other.localName and
+    element.namespace == other.namespace and
+    element.id == CAtomNull and other.id == CAtomNull and
+    element.cachedStyle == nil and other.cachedStyle == nil and
+    element.classList.toks == other.classList.toks and
+    element.sameAttrs(other)
+
+func find(cache: StyleSharingCache; styledParent: StyledNode;
+    element: Element): int =
+  for i, entry in cache.entries:
+    if entry.styledNode.parent == styledParent and
+        element.canShareWith(Element(entry.styledNode.node)):
+      return i
+  return -1
+
+proc add(cache: var StyleSharingCache; styledNode: StyledNode;
+    declmap: RuleListMap) =
+  if cache.entries.len >= StyleSharingCacheSize:
+    cache.entries.delete(0)
+  cache.entries.add(StyleSharingEntry(styledNode: styledNode, declmap: declmap))
+
+type
+  CascadeContext = object
+    ua: CSSStylesheet
+    user: CSSStylesheet
+    author: seq[CSSStylesheet]
+    ancestors: AncestorStack
+    sharingCache: StyleSharingCache
+    interner: CSSValuesInterner
+    buckets: seq[RuleBucket] # scratch buffer for calcRules
+
+  CascadeFrame = object
+    styledParent: StyledNode
+    child: Node
+    pseudo: PseudoElem
+    cachedChild: StyledNode
+    cachedChildren: seq[StyledNode]
+    parentDeclMap: RuleListMap
 
 proc getAuthorSheets(document: Document): seq[CSSStylesheet] =
   var author: seq[CSSStylesheet]
@@ -374,8 +491,8 @@ proc applyRulesFrameValid(frame: var CascadeFrame): StyledNode =
     styledParent.children.add(cachedChild)
   return cachedChild
 
-proc applyRulesFrameInvalid(frame: CascadeFrame; ua, user: CSSStylesheet;
-    author: seq[CSSStylesheet]; declmap: var RuleListMap): StyledNode =
+proc applyRulesFrameInvalid(frame: CascadeFrame; ctx: var CascadeContext;
+    declmap: var RuleListMap): StyledNode =
   var styledChild: StyledNode = nil
   let pseudo = frame.pseudo
   let styledParent = frame.styledParent
@@ -384,7 +501,8 @@ proc applyRulesFrameInvalid(frame: CascadeFrame; ua, user: CSSStylesheet;
     case pseudo
     of peBefore, peAfter:
       let declmap = frame.parentDeclMap
-      let styledPseudo = pseudo.applyDeclarations(styledParent, declmap)
+      let styledPseudo = pseudo.applyDeclarations(styledParent, declmap,
+        ctx.interner)
       if styledPseudo != nil and styledPseudo.computed{"content"}.len > 0:
         for content in styledPseudo.computed{"content"}:
           let child = styledPseudo.newStyledReplacement(content, peNone)
@@ -417,7 +535,7 @@ proc applyRulesFrameInvalid(frame: CascadeFrame; ua, user: CSSStylesheet;
       styledParent.children.add(styledText)
     of peCanvas:
       let bmp = HTMLCanvasElement(styledParent.node).bitmap
-      if bmp != nil and bmp.cacheId != 0:
+      if bmp != nil and bmp.cacheId != -1:
         let content = CSSContent(
           t: ContentImage,
           s: "canvas://",
@@ -445,8 +563,18 @@ proc applyRulesFrameInvalid(frame: CascadeFrame; ua, user: CSSStylesheet;
         let element = Element(child)
         styledChild = styledParent.newStyledElement(element)
         styledParent.children.add(styledChild)
-        declmap = styledChild.calcRules(ua, user, author)
-        applyStyle(styledParent, styledChild, declmap)
+        let i = ctx.sharingCache.find(styledParent, element)
+        if i != -1:
+          let shared = ctx.sharingCache.entries[i]
+          styledChild.computed = shared.styledNode.computed
+          styledChild.depends = shared.styledNode.depends
+          declmap = shared.declmap
+        else:
+          declmap = styledChild.calcRules(ctx.ua, ctx.user, ctx.author,
+            ctx.ancestors.filter, ctx.buckets)
+          applyStyle(styledParent, styledChild, declmap, ctx.interner)
+          if declmap.shareable:
+            ctx.sharingCache.add(styledChild, declmap)
       elif child of Text:
         let text = Text(child)
         styledChild = styledParent.newStyledText(text)
@@ -455,8 +583,9 @@ proc applyRulesFrameInvalid(frame: CascadeFrame; ua, user: CSSStylesheet;
       # Root element
       let element = Element(child)
       styledChild = newStyledElement(element)
-      declmap = styledChild.calcRules(ua, user, author)
-      applyStyle(styledParent, styledChild, declmap)
+      declmap = styledChild.calcRules(ctx.ua, ctx.user, ctx.author,
+        ctx.ancestors.filter, ctx.buckets)
+      applyStyle(styledParent, styledChild, declmap, ctx.interner)
   return styledChild
 
 proc stackAppend(styledStack: var seq[CascadeFrame]; frame: CascadeFrame;
@@ -527,21 +656,35 @@ proc appendChildren(styledStack: var seq[CascadeFrame]; frame: CascadeFrame;
   of TAG_BR: styledStack.stackAppend(frame, styledChild, peNewline, idx)
   of TAG_CANVAS: styledStack.stackAppend(frame, styledChild, peCanvas, idx)
   else:
-    for i in countdown(element.childList.high, 0):
-      let child = element.childList[i]
+    for child in element.childList_rev:
       if child of Element or child of Text:
         styledStack.stackAppend(frame, styledChild, child, idx)
     if element.tagType == TAG_INPUT:
       styledStack.stackAppend(frame, styledChild, peInputText, idx)
   styledStack.stackAppend(frame, styledChild, peBefore, idx, parentDeclMap)
 
+# Subtrees only depend on the rest of the tree through inherited values,
+# their own dependencies, and the ancestors' tags/IDs/classes/attributes
+# (and child lists).  So if an element was restyled only because one of its
+# dependencies changed (e.g. :hover on itself), and its style came out the
+# same as before, then its old children can be checked for validity as if
+# nothing had happened.
+func canReuseChildren(stale, styledNode: StyledNode): bool =
+  return stale.t == stElement and stale.pseudo == peNone and
+    stale.node == styledNode.node and not Element(stale.node).invalid and
+    stale.computed.sameValues(styledNode.computed)
+
 # Builds a StyledNode tree, optionally based on a previously cached version.
 proc applyRules(document: Document; ua, user: CSSStylesheet;
     cachedTree: StyledNode): StyledNode =
   let html = document.html
   if html == nil:
     return
-  let author = document.getAuthorSheets()
+  var ctx = CascadeContext(
+    ua: ua,
+    user: user,
+    author: document.getAuthorSheets()
+  )
   var styledStack = @[CascadeFrame(
     child: html,
     pseudo: peNone,
@@ -553,21 +696,31 @@ proc applyRules(document: Document; ua, user: CSSStylesheet;
     var frame = styledStack.pop()
     var declmap: RuleListMap
     let styledParent = frame.styledParent
+    # Frames are popped in tree order, so this leaves exactly the ancestors
+    # of the current node on the stack.
+    ctx.ancestors.popUntil(styledParent)
     let valid = frame.cachedChild != nil and frame.cachedChild.isValid(toReset)
+    var stale: StyledNode = nil
     let styledChild = if valid:
       frame.applyRulesFrameValid()
     else:
       # From here on, computed values of this node's children are invalid
       # because of property inheritance.
+      stale = frame.cachedChild
       frame.cachedChild = nil
-      frame.applyRulesFrameInvalid(ua, user, author, declmap)
+      frame.applyRulesFrameInvalid(ctx, declmap)
     if styledChild != nil:
       if styledParent == nil:
         # Root element
         root = styledChild
       if styledChild.t == stElement and styledChild.node != nil:
+        if stale != nil and stale.canReuseChildren(styledChild):
+          # ...unless they turn out to be the same as before.  Pseudo
+          # elements are still rebuilt, since frame.cachedChild is nil.
+          frame.cachedChildren = move(stale.children)
         # note: following resets styledChild.node's invalid flag
         styledStack.appendChildren(frame, styledChild, declmap)
+        ctx.ancestors.push(styledChild)
   for element in toReset:
     element.invalidDeps = {}
   return root
@@ -1,4 +1,5 @@
 import std/algorithm
+import std/hashes
 import std/macros
 import std/options
 import std/strutils
@@ -305,6 +306,29 @@ type
     OverflowScroll = "scroll"
     OverflowAuto = "auto"
 
+const InheritedProperties = {
+  cptColor, cptFontStyle, cptWhiteSpace, cptFontWeight, cptTextDecoration,
+  cptWordBreak, cptListStyleType, cptLineHeight, cptTextAlign,
+  cptListStylePosition, cptCaptionSide, cptBorderSpacing, cptBorderCollapse,
+  cptQuotes, cptVisibility, cptTextTransform
+}
+
+const InheritedPropertyCount = card(InheritedProperties)
+const ResetPropertyCount = CSSPropertyType.high.ord + 1 - InheritedPropertyCount
+
+# Index of each property in its value block.
+const PropertyBlockIndex = (func(): array[CSSPropertyType, int] =
+  var i = 0
+  var j = 0
+  for t in CSSPropertyType:
+    if t in InheritedProperties:
+      result[t] = i
+      inc i
+    else:
+      result[t] = j
+      inc j
+)()
+
 type
   CSSLength* = object
     num*: float64
@@ -392,7 +416,29 @@ type
       overflow*: CSSOverflow
     of cvtNone: discard
 
-  CSSComputedValues* = ref array[CSSPropertyType, CSSComputedValue]
+  # Computed values are stored in two blocks: one for inherited, and one for
+  # non-inherited properties.  Blocks are shared between CSSComputedValues
+  # objects where possible (e.g. anonymous boxes just take their parent's
+  # inherited block), and copied on write once shared.
+  CSSInheritedValues = ref object
+    shared: bool
+    vals: array[InheritedPropertyCount, CSSComputedValue]
+
+  CSSResetValues = ref object
+    shared: bool
+    vals: array[ResetPropertyCount, CSSComputedValue]
+
+  CSSComputedValues* = ref object
+    inherited: CSSInheritedValues
+    reset: CSSResetValues
+
+  # Deduplicates value blocks.  Values are compared by identity; since
+  # declared values are shared by all elements a rule matches, and
+  # inherited/initial values are shared too, elements with the same rules
+  # and parent style end up with the same blocks.
+  CSSValuesInterner* = object
+    inherited: Table[Hash, seq[CSSInheritedValues]]
+    reset: Table[Hash, seq[CSSResetValues]]
 
   CSSOrigin* = enum
     coUserAgent
@@ -461,13 +507,6 @@ const ValueTypes = [
   cptOverflow: cvtOverflow
 ]
 
-const InheritedProperties = {
-  cptColor, cptFontStyle, cptWhiteSpace, cptFontWeight, cptTextDecoration,
-  cptWordBreak, cptListStyleType, cptLineHeight, cptTextAlign,
-  cptListStylePosition, cptCaptionSide, cptBorderSpacing, cptBorderCollapse,
-  cptQuotes, cptVisibility, cptTextTransform
-}
-
 func shorthandType(s: string): CSSShorthandType =
   return parseEnumNoCase[CSSShorthandType](s).get(cstNone)
 
@@ -536,6 +575,62 @@ func `$`*(val: CSSComputedValue): string =
   of cvtOverflow: return $val.overflow
   of cvtNumber: return $val.number
 
+func newCSSComputedValues*(): CSSComputedValues =
+  return CSSComputedValues(
+    inherited: CSSInheritedValues(),
+    reset: CSSResetValues()
+  )
+
+func `[]`*(vals: CSSComputedValues; t: CSSPropertyType): CSSComputedValue
+    {.inline.} =
+  if t in InheritedProperties:
+    return vals.inherited.vals[PropertyBlockIndex[t]]
+  return vals.reset.vals[PropertyBlockIndex[t]]
+
+func `[]=`*(vals: CSSComputedValues; t: CSSPropertyType;
+    val: CSSComputedValue) =
+  let i = PropertyBlockIndex[t]
+  if t in InheritedProperties:
+    if vals.inherited.shared:
+      vals.inherited = CSSInheritedValues(vals: vals.inherited.vals)
+    vals.inherited.vals[i] = val
+  else:
+    if vals.reset.shared:
+      vals.reset = CSSResetValues(vals: vals.reset.vals)
+    vals.reset.vals[i] = val
+
+# Cheap if both have been interned: then equal blocks are the same object.
+func sameValues*(a, b: CSSComputedValues): bool =
+  return (a.inherited == b.inherited or
+      a.inherited.vals == b.inherited.vals) and
+    (a.reset == b.reset or a.reset.vals == b.reset.vals)
+
+func hash(vals: openArray[CSSComputedValue]): Hash =
+  var h: Hash = 0
+  for val in vals:
+    h = h !& hash(cast[pointer](val))
+  return !$h
+
+template internBlock(table, vblock: untyped) =
+  let h = hash(vblock.vals)
+  table.withValue(h, p):
+    var found = false
+    for it in p[]:
+      if it.vals == vblock.vals:
+        vblock = it
+        found = true
+        break
+    if not found:
+      vblock.shared = true
+      p[].add(vblock)
+  do:
+    vblock.shared = true
+    table[h] = @[vblock]
+
+proc intern*(interner: var CSSValuesInterner; vals: CSSComputedValues) =
+  internBlock(interner.inherited, vals.inherited)
+  internBlock(interner.reset, vals.reset)
+
 macro `{}`*(vals: CSSComputedValues; s: static string): untyped =
   let t = propertyType(s)
   let vs = ident($valueType(t))
@@ -1295,6 +1390,18 @@ template getDefault*(t: CSSPropertyType): CSSComputedValue =
   {.cast(noSideEffect).}:
     defaultTable[t]
 
+func getInitialBlocks(): (CSSInheritedValues, CSSResetValues) =
+  let inherited = CSSInheritedValues(shared: true)
+  let reset = CSSResetValues(shared: true)
+  for t in CSSPropertyType:
+    if t in InheritedProperties:
+      inherited.vals[PropertyBlockIndex[t]] = getDefault(t)
+    else:
+      reset.vals[PropertyBlockIndex[t]] = getDefault(t)
+  return (inherited, reset)
+
+let (defaultInherited, defaultReset) = getInitialBlocks()
+
 func lengthShorthand(cvals: openArray[CSSComponentValue];
     props: array[4, CSSPropertyType]; global: CSSGlobalType; has_auto = true):
     Opt[seq[CSSComputedEntry]] =
@@ -1512,29 +1619,34 @@ proc applyValue*(vals: CSSComputedValues; entry: CSSComputedEntry;
     vals[entry.t] = entry.val
 
 func inheritProperties*(parent: CSSComputedValues): CSSComputedValues =
-  new(result)
-  for prop in CSSPropertyType:
-    if inherited(prop) and parent[prop] != nil:
-      result[prop] = parent[prop]
-    else:
+  {.cast(noSideEffect).}:
+    result = CSSComputedValues(
+      inherited: parent.inherited,
+      reset: defaultReset
+    )
+  parent.inherited.shared = true
+  for prop in InheritedProperties:
+    if parent[prop] == nil:
       result[prop] = getDefault(prop)
 
 func copyProperties*(props: CSSComputedValues): CSSComputedValues =
-  new(result)
-  result[] = props[]
+  props.inherited.shared = true
+  props.reset.shared = true
+  return CSSComputedValues(inherited: props.inherited, reset: props.reset)
 
 func rootProperties*(): CSSComputedValues =
-  new(result)
-  for prop in CSSPropertyType:
-    result[prop] = getDefault(prop)
+  {.cast(noSideEffect).}:
+    return CSSComputedValues(
+      inherited: defaultInherited,
+      reset: defaultReset
+    )
 
 # Separate CSSComputedValues of a table into those of the wrapper and the actual
 # table.
 func splitTable*(computed: CSSComputedValues):
     tuple[outerComputed, innnerComputed: CSSComputedValues] =
-  var outerComputed, innerComputed: CSSComputedValues
-  new(outerComputed)
-  new(innerComputed)
+  let outerComputed = newCSSComputedValues()
+  let innerComputed = newCSSComputedValues()
   const props = {
     cptPosition, cptFloat, cptMarginLeft, cptMarginRight, cptMarginTop,
     cptMarginBottom, cptTop, cptRight, cptBottom, cptLeft,
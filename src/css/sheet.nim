@@ -1,5 +1,7 @@
+import std/algorithm
 import std/tables
 
+import css/bloomfilter
 import css/cssparser
 import css/cssvalues
 import css/mediaquery
@@ -14,9 +16,25 @@ type
     sels*: SelectorList
     normalVals*: seq[CSSComputedEntry]
     importantVals*: seq[CSSComputedEntry]
-    # Absolute position in the stylesheet; used for sorting rules after
-    # retrieval from the cache.
+    # Absolute position in the stylesheet.
     idx: int
+    # For each selector in sels, hashes of the tags/IDs/classes that must be
+    # present on some ancestor of the subject for it to match.
+    ancestorHashes*: seq[seq[uint32]]
+    # False if some selector depends on more than the subject's tag, ID,
+    # classes, attributes and ancestors (e.g. sibling combinators, or
+    # pseudo-classes like :hover on the subject).  Elements that have
+    # such rules in their candidate set can't share their style.
+    shareable*: bool
+
+  # One selector of a rule, as stored in the stylesheet's lookup tables.
+  CSSRuleSelector* = object
+    rule*: CSSRuleDef
+    sel*: int # index in rule.sels
+    # Position in the cascade: specificity in the upper 32 bits, rule index
+    # in the lower 32 bits.  Lookup tables are sorted by rank, so matching
+    # rules can be collected in cascade order without sorting.
+    rank*: uint64
 
   CSSConditionalDef* = ref object of CSSRuleBase
     children*: CSSStylesheet
@@ -26,11 +44,11 @@ type
 
   CSSStylesheet* = ref object
     mqList*: seq[CSSMediaQueryDef]
-    tagTable*: Table[CAtom, seq[CSSRuleDef]]
-    idTable*: Table[CAtom, seq[CSSRuleDef]]
-    classTable*: Table[CAtom, seq[CSSRuleDef]]
-    attrTable*: Table[CAtom, seq[CSSRuleDef]]
-    generalList*: seq[CSSRuleDef]
+    tagTable*: Table[CAtom, seq[CSSRuleSelector]]
+    idTable*: Table[CAtom, seq[CSSRuleSelector]]
+    classTable*: Table[CAtom, seq[CSSRuleSelector]]
+    attrTable*: Table[CAtom, seq[CSSRuleSelector]]
+    generalList*: seq[CSSRuleSelector]
     len: int
     factory: CAtomFactory
 
@@ -43,11 +61,11 @@ type SelectorHashes = object
 func newStylesheet*(cap: int; factory: CAtomFactory): CSSStylesheet =
   let bucketsize = cap div 2
   return CSSStylesheet(
-    tagTable: initTable[CAtom, seq[CSSRuleDef]](bucketsize),
-    idTable: initTable[CAtom, seq[CSSRuleDef]](bucketsize),
-    classTable: initTable[CAtom, seq[CSSRuleDef]](bucketsize),
-    attrTable: initTable[CAtom, seq[CSSRuleDef]](bucketsize),
-    generalList: newSeqOfCap[CSSRuleDef](bucketsize),
+    tagTable: initTable[CAtom, seq[CSSRuleSelector]](bucketsize),
+    idTable: initTable[CAtom, seq[CSSRuleSelector]](bucketsize),
+    classTable: initTable[CAtom, seq[CSSRuleSelector]](bucketsize),
+    attrTable: initTable[CAtom, seq[CSSRuleSelector]](bucketsize),
+    generalList: newSeqOfCap[CSSRuleSelector](bucketsize),
     factory: factory
   )
 
@@ -125,53 +143,161 @@ proc getSelectorIds(hashes: var SelectorHashes; sel: Selector): bool =
     return hashes.tag != CAtomNull or hashes.id != CAtomNull or
       hashes.class != CAtomNull
 
-proc ruleDefCmp*(a, b: CSSRuleDef): int =
-  cmp(a.idx, b.idx)
+# Only check the first few; the rest is unlikely to filter out anything
+# the first ones wouldn't.
+const MaxAncestorHashes = 4
+
+proc addAncestorHashes(hashes: var seq[uint32]; cxsel: ComplexSelector;
+    self: bool)
+
+# Add the hashes of compound if self is set, i.e. if it must match an
+# ancestor of the subject. Arguments of :is/:where are treated as part of
+# the compound, but only what all of them require is added.
+proc addAncestorHashes(hashes: var seq[uint32]; compound: CompoundSelector;
+    self: bool) =
+  for sel in compound:
+    case sel.t
+    of stType:
+      if self:
+        hashes.add(sel.tag.ancestorHash(ahkTag))
+    of stId:
+      if self:
+        hashes.add(sel.id.ancestorHash(ahkId))
+    of stClass:
+      if self:
+        hashes.add(sel.class.ancestorHash(ahkClass))
+    of stPseudoClass:
+      if sel.pseudo.t in {pcIs, pcWhere}:
+        var common: seq[uint32] = @[]
+        for i, cxsel in sel.pseudo.fsels:
+          var it: seq[uint32] = @[]
+          it.addAncestorHashes(cxsel, self)
+          if i == 0:
+            common = move(it)
+          else:
+            var j = 0
+            while j < common.len:
+              if common[j] in it:
+                inc j
+              else:
+                common.del(j)
+        hashes.add(common)
+    else: discard
+
+# The last compound of cxsel is an ancestor of the subject if self is set.
+# ct is the combinator to the right of a compound, so descendant/child
+# compounds must match an ancestor of the last one. (Even after a sibling
+# combinator, because siblings share their ancestors.)
+proc addAncestorHashes(hashes: var seq[uint32]; cxsel: ComplexSelector;
+    self: bool) =
+  for i, compound in cxsel:
+    if i < cxsel.high:
+      hashes.addAncestorHashes(compound, compound.ct in {ctDescendant, ctChild})
+    else:
+      hashes.addAncestorHashes(compound, self)
+
+proc getAncestorHashes(cxsel: ComplexSelector): seq[uint32] =
+  result = @[]
+  result.addAncestorHashes(cxsel, self = false)
+  if result.len > MaxAncestorHashes:
+    result.setLen(MaxAncestorHashes)
+
+func isShareable(cxsel: ComplexSelector): bool =
+  for compound in cxsel:
+    if compound.ct in {ctNextSibling, ctSubsequentSibling}:
+      return false
+  # Pseudo-classes on ancestors evaluate the same for all siblings; on the
+  # subject, only those that don't depend on its state or position do, and
+  # :is/:where/:not if their arguments are shareable.
+  for sel in cxsel[^1]:
+    if sel.t == stPseudoClass:
+      case sel.pseudo.t
+      of pcRoot, pcLang, pcLink, pcVisited:
+        discard
+      of pcIs, pcWhere, pcNot:
+        for it in sel.pseudo.fsels:
+          if not it.isShareable():
+            return false
+      else:
+        return false
+  return true
+
+func rankCmp(a, b: CSSRuleSelector): int =
+  cmp(a.rank, b.rank)
 
 proc add(sheet: CSSStylesheet; rule: CSSRuleDef) =
-  var hashes = SelectorHashes()
-  for cxsel in rule.sels:
+  for i, cxsel in rule.sels:
+    var hashes = SelectorHashes()
     hashes.getSelectorIds(cxsel)
+    let rank = (uint64(getSpecificity(cxsel)) shl 32) or uint64(rule.idx)
+    let it = CSSRuleSelector(rule: rule, sel: i, rank: rank)
     if hashes.tag != CAtomNull:
       sheet.tagTable.withValue(hashes.tag, p):
-        p[].add(rule)
+        p[].add(it)
       do:
-        sheet.tagTable[hashes.tag] = @[rule]
+        sheet.tagTable[hashes.tag] = @[it]
     elif hashes.id != CAtomNull:
       sheet.idTable.withValue(hashes.id, p):
-        p[].add(rule)
+        p[].add(it)
       do:
-        sheet.idTable[hashes.id] = @[rule]
+        sheet.idTable[hashes.id] = @[it]
     elif hashes.class != CAtomNull:
       sheet.classTable.withValue(hashes.class, p):
-        p[].add(rule)
+        p[].add(it)
       do:
-        sheet.classTable[hashes.class] = @[rule]
+        sheet.classTable[hashes.class] = @[it]
     else:
-      sheet.generalList.add(rule)
+      sheet.generalList.add(it)
 
-proc add*(sheet, sheet2: CSSStylesheet) =
-  sheet.generalList.add(sheet2.generalList)
-  for key, value in sheet2.tagTable.pairs:
-    sheet.tagTable.withValue(key, p):
-      p[].add(value)
-    do:
-      sheet.tagTable[key] = value
-  for key, value in sheet2.idTable.pairs:
-    sheet.idTable.withValue(key, p):
-      p[].add(value)
-    do:
-      sheet.idTable[key] = value
-  for key, value in sheet2.classTable.pairs:
-    sheet.classTable.withValue(key, p):
-      p[].add(value)
-    do:
-      sheet.classTable[key] = value
-  for key, value in sheet2.attrTable.pairs:
-    sheet.attrTable.withValue(key, p):
-      p[].add(value)
+# Rules are added in source order, so this must be called once all rules
+# of a sheet have been added.
+proc sortTables(sheet: CSSStylesheet) =
+  sheet.generalList.sort(rankCmp)
+  for it in sheet.tagTable.mvalues:
+    it.sort(rankCmp)
+  for it in sheet.idTable.mvalues:
+    it.sort(rankCmp)
+  for it in sheet.classTable.mvalues:
+    it.sort(rankCmp)
+  for it in sheet.attrTable.mvalues:
+    it.sort(rankCmp)
+
+proc merge(a: var seq[CSSRuleSelector]; b: seq[CSSRuleSelector]) =
+  if b.len == 0:
+    return
+  if a.len == 0 or a[^1].rank <= b[0].rank:
+    a.add(b)
+    return
+  var res = newSeqOfCap[CSSRuleSelector](a.len + b.len)
+  var i = 0
+  var j = 0
+  while i < a.len and j < b.len:
+    if b[j].rank < a[i].rank:
+      res.add(b[j])
+      inc j
+    else:
+      res.add(a[i])
+      inc i
+  for k in i ..< a.len:
+    res.add(a[k])
+  for k in j ..< b.len:
+    res.add(b[k])
+  a = move(res)
+
+proc merge(a: var Table[CAtom, seq[CSSRuleSelector]];
+    b: Table[CAtom, seq[CSSRuleSelector]]) =
+  for key, value in b.pairs:
+    a.withValue(key, p):
+      p[].merge(value)
     do:
-      sheet.attrTable[key] = value
+      a[key] = value
+
+proc add*(sheet, sheet2: CSSStylesheet) =
+  sheet.generalList.merge(sheet2.generalList)
+  sheet.tagTable.merge(sheet2.tagTable)
+  sheet.idTable.merge(sheet2.idTable)
+  sheet.classTable.merge(sheet2.classTable)
+  sheet.attrTable.merge(sheet2.attrTable)
 
 proc addRule(stylesheet: CSSStylesheet; rule: CSSQualifiedRule) =
   let sels = parseSelectors(rule.prelude, stylesheet.factory)
@@ -185,11 +311,18 @@ proc addRule(stylesheet: CSSStylesheet; rule: CSSQualifiedRule) =
         importantVals.add(vals)
       else:
         normalVals.add(vals)
+    var ancestorHashes = newSeqOfCap[seq[uint32]](sels.len)
+    var shareable = true
+    for cxsel in sels:
+      ancestorHashes.add(cxsel.getAncestorHashes())
+      shareable = shareable and cxsel.isShareable()
     stylesheet.add(CSSRuleDef(
       sels: sels,
       normalVals: normalVals,
       importantVals: importantVals,
-      idx: stylesheet.len
+      idx: stylesheet.len,
+      ancestorHashes: ancestorHashes,
+      shareable: shareable
     ))
     inc stylesheet.len
 
@@ -210,6 +343,7 @@ proc addAtRule(stylesheet: CSSStylesheet; atrule: CSSAtRule) =
           media.children.addAtRule(CSSAtRule(rule))
         else:
           media.children.addRule(CSSQualifiedRule(rule))
+      media.children.sortTables()
       stylesheet.mqList.add(media)
       stylesheet.len = media.children.len
 
@@ -221,4 +355,5 @@ proc parseStylesheet*(ibuf: string; factory: CAtomFactory): CSSStylesheet =
       sheet.addAtRule(CSSAtRule(v))
     else:
       sheet.addRule(CSSQualifiedRule(v))
+  sheet.sortTables()
   return sheet
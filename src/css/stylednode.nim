@@ -39,13 +39,24 @@ type
 
   DependencyInfo = array[DependencyType, seq[Element]]
 
+  # Text of a text node after text-transform and normalization, along with
+  # the widths of its non-ASCII code points. Layout keeps it in the styled
+  # node, so that relayouts only have to fit the text into lines again.
+  TextShape* = object
+    built*: bool
+    generation*: uint32 # generation of the text data the shape was built from
+    transform*: CSSTextTransform
+    copy*: bool # s holds the text; if false, the node's data is used as is
+    s*: string
+    widths*: seq[uint8]
+
   StyledNode* = ref object
     parent*: StyledNode
     node*: Node
     pseudo*: PseudoElem
     case t*: StyledType
     of stText:
-      discard
+      shape*: TextShape
     of stElement:
       computed*: CSSComputedValues
       children*: seq[StyledNode]
@@ -58,6 +69,9 @@ type
 template textData*(styledNode: StyledNode): string =
   CharacterData(styledNode.node).data
 
+template textGeneration*(styledNode: StyledNode): uint32 =
+  CharacterData(styledNode.node).generation
+
 # For debugging
 func `$`*(node: StyledNode): string =
   if node == nil:
@@ -165,7 +165,7 @@ proc insertTextImpl(builder: ChaDOMBuilder; parent: Node; text: string;
   else:
     parent.lastChild
   if prevSibling != nil and prevSibling of Text:
-    Text(prevSibling).data &= text
+    Text(prevSibling).appendData(text)
     if parent of Element:
       Element(parent).invalid = true
   else:
@@ -1,6 +1,7 @@
 import std/algorithm
 import std/deques
 import std/math
+import std/monotimes
 import std/options
 import std/posix
 import std/sets
@@ -105,8 +106,10 @@ type
     styling*: bool
     # ID of the next image
     imageId: int
-    # list of streams that must be closed for canvas rendering on load
-    pendingCanvasCtls*: seq[CanvasRenderingContext2D]
+    # canvas contexts with an open control stream
+    canvasCtls*: seq[CanvasRenderingContext2D]
+    # set when a canvas has received a new frame from its renderer
+    newCanvasFrames*: bool
 
   # Navigator stuff
   Navigator* = object
@@ -134,6 +137,7 @@ type
     root: Node
     match: proc(node: Node): bool {.noSideEffect.}
     snapshot: seq[Node]
+    gen: int # root.subtreeGen when the snapshot was taken
     livelen: int
 
   NodeList = ref object of Collection
@@ -151,13 +155,15 @@ type
     target {.cursor.}: HTMLElement
 
   Node* = ref object of EventTarget
-    childList*: seq[Node]
     parentNode* {.jsget.}: Node
-    index*: int # Index in parents children. -1 for nodes without a parent.
-    # Live collection cache: pointers to live collections are saved in all
-    # nodes they refer to. These are removed when the collection is destroyed,
-    # and invalidated when the owner node's children or attributes change.
-    liveCollections: HashSet[pointer]
+    firstChild* {.jsget.}: Node
+    lastChild* {.jsget.}: Node
+    previousSibling* {.jsget.}: Node
+    nextSibling* {.jsget.}: Node
+    # Incremented whenever the children or the attributes of this node or
+    # one of its descendants change. Live collections are rebuilt when they
+    # are read after their root's generation has changed.
+    subtreeGen: int
     cachedChildNodes: NodeList
     internalDocument: Document # not nil
 
@@ -199,8 +205,10 @@ type
     contentType* {.jsget.}: string
     renderBlockingElements: seq[Element]
 
-    invalidCollections: HashSet[pointer] # pointers to Collection objects
     invalid*: bool # whether the document must be rendered again
+    # Connected elements with an ID, by ID. (Usually just one per ID; the
+    # order of elements sharing an ID is not the tree order.)
+    idMap: Table[CAtom, seq[Element]]
 
     cachedAll: HTMLAllCollection
     cachedSheets: seq[CSSStylesheet]
@@ -211,6 +219,7 @@ type
 
   CharacterData* = ref object of Node
     data* {.jsget.}: string
+    generation*: uint32 # incremented on every change of data
 
   Text* = ref object of CharacterData
 
@@ -372,6 +381,22 @@ type
     state: DrawingState
     stateStack: seq[DrawingState]
     ps*: PosixStream
+    # set if commands have been sent since the last frame boundary
+    frameDirty: bool
+    # the renderer's output, if its latest frame is held back until
+    # nextFrameStore
+    pendingFrame: CanvasFrameOpaque
+    nextFrameStore: MonoTime
+
+  # The renderer outputs the damaged area of each frame as x, y, width and
+  # height followed by the pixels of that area. Frames are assembled in px,
+  # and each one is stored in a cache file of its own, so that the pager only
+  # ever decodes a single, complete image.
+  CanvasFrameOpaque = ref object of RootObj
+    ctx: CanvasRenderingContext2D
+    window: Window
+    buf: seq[uint8]
+    px: seq[RGBAColorBE]
 
   TextMetrics = ref object
     # x-direction
@@ -465,6 +490,7 @@ proc delAttr(element: Element; i: int; keep = false)
 proc getImageId(window: Window): int
 proc parseColor(element: Element; s: string): ARGBColor
 proc reflectAttr(element: Element; name: CAtom; value: Option[string])
+proc setInvalid*(element: Element)
 
 # Forward declaration hacks
 # set in css/cascade
@@ -510,6 +536,137 @@ proc reset(state: var DrawingState) =
   state.strokeStyle = rgba(0, 0, 0, 255)
   state.path = newPath()
 
+# Store px as a command stream that draws the whole frame, and point the
+# bitmap at it.
+proc storeCanvasFrame(opaque: CanvasFrameOpaque) =
+  let window = opaque.window
+  let loader = window.loader
+  let bitmap = opaque.ctx.canvas.bitmap
+  var pipefd: array[2, cint]
+  if pipe(pipefd) == -1:
+    return
+  let id = "canvas-frame-" & $bitmap.imageId
+  loader.passFd(id, FileHandle(pipefd[0]))
+  discard close(pipefd[0])
+  let ps = newPosixStream(FileHandle(pipefd[1]))
+  let res = loader.doRequest(newRequest(newURL("stream:" & id).get))
+  if res.res != 0:
+    ps.sclose()
+    return
+  let cacheId = loader.addCacheFile(res.outputId, loader.clientPid)
+  res.resume()
+  res.close()
+  try:
+    ps.withPacketWriter w:
+      w.swrite(pcSetDimensions)
+      w.swrite(bitmap.width)
+      w.swrite(bitmap.height)
+    ps.withPacketWriter w:
+      w.swrite(pcDrawImage)
+      w.swrite(0)
+      w.swrite(0)
+      w.swrite(bitmap.width)
+      w.swrite(bitmap.height)
+      w.writeData(addr opaque.px[0], opaque.px.len * sizeof(opaque.px[0]))
+  except ErrorBrokenPipe:
+    discard
+  ps.sclose()
+  if cacheId == -1:
+    return
+  # The pager shares the file before loading it, so the previous frame
+  # may be dropped right away.
+  if bitmap.cacheId != -1:
+    loader.removeCachedItem(bitmap.cacheId)
+  bitmap.cacheId = cacheId
+  inc bitmap.frame
+  # re-render so that the pager receives the new frame
+  opaque.ctx.canvas.setInvalid()
+  window.newCanvasFrames = true
+
+# Minimum time between two stored frames of a canvas. Every frame is a full
+# snapshot that the pager decodes again, so storing more of them than can be
+# displayed only churns the cache. (Sending just the damaged area for the
+# pager to patch in would lift this limit.)
+const CanvasFrameInterval = initDuration(milliseconds = 100)
+
+proc queueCanvasFrame(opaque: CanvasFrameOpaque) =
+  let ctx = opaque.ctx
+  let now = getMonoTime()
+  if now >= ctx.nextFrameStore:
+    ctx.pendingFrame = nil
+    ctx.nextFrameStore = now + CanvasFrameInterval
+    opaque.storeCanvasFrame()
+  else:
+    # px keeps being updated; whatever it holds once the interval is over
+    # gets stored
+    ctx.pendingFrame = opaque
+
+# Store the frames held back by the rate limit that are due. Returns the time
+# until the next one is due in milliseconds, or -1 if none is left.
+proc storePendingCanvasFrames*(window: Window): int =
+  result = -1
+  let now = getMonoTime()
+  for ctx in window.canvasCtls:
+    if ctx.pendingFrame == nil:
+      continue
+    if now >= ctx.nextFrameStore:
+      let opaque = ctx.pendingFrame
+      ctx.pendingFrame = nil
+      ctx.nextFrameStore = now + CanvasFrameInterval
+      opaque.storeCanvasFrame()
+    else:
+      let ns = (ctx.nextFrameStore - now).inNanoseconds
+      let ms = int((ns + 999_999) div 1_000_000)
+      if result == -1 or ms < result:
+        result = ms
+
+proc onReadCanvas(response: Response) =
+  const BufferSize = 4096
+  let opaque = CanvasFrameOpaque(response.opaque)
+  while true:
+    let olen = opaque.buf.len
+    try:
+      opaque.buf.setLen(olen + BufferSize)
+      let n = response.body.recvData(addr opaque.buf[olen], BufferSize)
+      opaque.buf.setLen(olen + n)
+      if n == 0:
+        break
+    except ErrorAgain:
+      opaque.buf.setLen(olen)
+      break
+  if opaque.ctx.ps == nil:
+    # the canvas has been resized; its renderer is on its way out
+    opaque.buf.setLen(0)
+    return
+  let bitmap = opaque.ctx.canvas.bitmap
+  var i = 0
+  var damaged = false
+  while true:
+    var rect {.noinit.}: array[4, int] # x, y, width, height
+    if opaque.buf.len - i < sizeof(rect):
+      break
+    copyMem(addr rect[0], addr opaque.buf[i], sizeof(rect))
+    let (x, y, w, h) = (rect[0], rect[1], rect[2], rect[3])
+    if x < 0 or y < 0 or w < 0 or h < 0 or w > bitmap.width - x or
+        h > bitmap.height - y:
+      opaque.buf.setLen(0) # garbage; give up on the frame
+      return
+    let rowLen = w * sizeof(opaque.px[0])
+    if opaque.buf.len - i - sizeof(rect) < rowLen * h:
+      break
+    i += sizeof(rect)
+    for row in y ..< y + h:
+      copyMem(addr opaque.px[row * bitmap.width + x], addr opaque.buf[i],
+        rowLen)
+      i += rowLen
+    damaged = true
+  let left = opaque.buf.len - i
+  if left > 0 and i > 0:
+    moveMem(addr opaque.buf[0], addr opaque.buf[i], left)
+  opaque.buf.setLen(left)
+  if damaged:
+    opaque.queueCanvasFrame()
+
 proc create2DContext*(jctx: JSContext; target: HTMLCanvasElement;
     options = JS_UNDEFINED) =
   var pipefd: array[2, cint]
@@ -524,63 +681,78 @@ proc create2DContext*(jctx: JSContext; target: HTMLCanvasElement;
   let ctlreq = newRequest(newURL("stream:canvas-ctl-" & $imageId).get)
   let ctlres = loader.doRequest(ctlreq)
   doAssert ctlres.res == 0
-  let cacheId = loader.addCacheFile(ctlres.outputId, loader.clientPid)
-  target.bitmap.cacheId = cacheId
+  # The renderer stays alive for as long as the control stream is open,
+  # and outputs each frame as it is completed.
   let request = newRequest(
-    newURL("img-codec+x-cha-canvas:decode").get,
+    newURL("img-codec+x-cha-canvas:render").get,
     httpMethod = hmPost,
-    headers = newHeaders({"Cha-Image-Info-Only": "1"}),
     body = RequestBody(t: rbtOutput, outputId: ctlres.outputId)
   )
-  let response = loader.doRequest(request)
-  if response.res != 0:
-    # no canvas module; give up
-    ps.sclose()
-    ctlres.resume()
-    ctlres.close()
-    return
+  let p = loader.fetch(request)
   ctlres.resume()
   ctlres.close()
-  response.resume()
-  target.ctx2d = CanvasRenderingContext2D(
+  let ctx = CanvasRenderingContext2D(
     bitmap: target.bitmap,
     canvas: target,
     ps: ps
   )
-  window.pendingCanvasCtls.add(target.ctx2d)
+  target.ctx2d = ctx
+  window.canvasCtls.add(ctx)
   ps.withPacketWriter w:
     w.swrite(pcSetDimensions)
     w.swrite(target.bitmap.width)
     w.swrite(target.bitmap.height)
-  target.ctx2d.state.reset()
+  ctx.state.reset()
+  p.then(proc(res: JSResult[Response]) =
+    if res.isNone:
+      # no canvas module; give up
+      if ctx.ps != nil:
+        let i = window.canvasCtls.find(ctx)
+        window.canvasCtls.del(i)
+        ctx.ps.sclose()
+        ctx.ps = nil
+      return
+    let response = res.get
+    response.opaque = CanvasFrameOpaque(
+      ctx: ctx,
+      window: window,
+      px: newSeq[RGBAColorBE](target.bitmap.width * target.bitmap.height)
+    )
+    response.onRead = onReadCanvas
+    response.resume()
+  )
 
-proc fillRect(ctx: CanvasRenderingContext2D; x1, y1, x2, y2: int;
-    color: ARGBColor) =
+template withCommandWriter(ctx: CanvasRenderingContext2D; w, body: untyped) =
   if ctx.ps != nil:
     ctx.ps.withPacketWriter w:
-      w.swrite(pcFillRect)
-      w.swrite(x1)
-      w.swrite(y1)
-      w.swrite(x2)
-      w.swrite(y2)
-      w.swrite(color)
+      body
+    ctx.frameDirty = true
+
+proc fillRect(ctx: CanvasRenderingContext2D; x1, y1, x2, y2: int;
+    color: ARGBColor) =
+  ctx.withCommandWriter w:
+    w.swrite(pcFillRect)
+    w.swrite(x1)
+    w.swrite(y1)
+    w.swrite(x2)
+    w.swrite(y2)
+    w.swrite(color)
 
 proc strokeRect(ctx: CanvasRenderingContext2D; x1, y1, x2, y2: int;
     color: ARGBColor) =
-  if ctx.ps != nil:
-    ctx.ps.withPacketWriter w:
-      w.swrite(pcStrokeRect)
-      w.swrite(x1)
-      w.swrite(y1)
-      w.swrite(x2)
-      w.swrite(y2)
-      w.swrite(color)
+  ctx.withCommandWriter w:
+    w.swrite(pcStrokeRect)
+    w.swrite(x1)
+    w.swrite(y1)
+    w.swrite(x2)
+    w.swrite(y2)
+    w.swrite(color)
 
 proc fillPath(ctx: CanvasRenderingContext2D; path: Path; color: ARGBColor;
     fillRule: CanvasFillRule) =
   if ctx.ps != nil:
     let lines = path.getLineSegments()
-    ctx.ps.withPacketWriter w:
+    ctx.withCommandWriter w:
       w.swrite(pcFillPath)
       w.swrite(lines)
       w.swrite(color)
@@ -589,39 +761,53 @@ proc fillPath(ctx: CanvasRenderingContext2D; path: Path; color: ARGBColor;
 proc strokePath(ctx: CanvasRenderingContext2D; path: Path; color: ARGBColor) =
   if ctx.ps != nil:
     let lines = path.getLines()
-    ctx.ps.withPacketWriter w:
+    ctx.withCommandWriter w:
       w.swrite(pcStrokePath)
       w.swrite(lines)
       w.swrite(color)
 
 proc fillText(ctx: CanvasRenderingContext2D; text: string; x, y: float64;
     color: ARGBColor; align: CanvasTextAlign) =
-  if ctx.ps != nil:
-    ctx.ps.withPacketWriter w:
-      w.swrite(pcFillText)
-      w.swrite(text)
-      w.swrite(x)
-      w.swrite(y)
-      w.swrite(color)
-      w.swrite(align)
+  ctx.withCommandWriter w:
+    w.swrite(pcFillText)
+    w.swrite(text)
+    w.swrite(x)
+    w.swrite(y)
+    w.swrite(color)
+    w.swrite(align)
 
 proc strokeText(ctx: CanvasRenderingContext2D; text: string; x, y: float64;
     color: ARGBColor; align: CanvasTextAlign) =
-  if ctx.ps != nil:
-    ctx.ps.withPacketWriter w:
-      w.swrite(pcStrokeText)
-      w.swrite(text)
-      w.swrite(x)
-      w.swrite(y)
-      w.swrite(color)
-      w.swrite(align)
+  ctx.withCommandWriter w:
+    w.swrite(pcStrokeText)
+    w.swrite(text)
+    w.swrite(x)
+    w.swrite(y)
+    w.swrite(color)
+    w.swrite(align)
 
 proc clearRect(ctx: CanvasRenderingContext2D; x1, y1, x2, y2: int) =
-  ctx.fillRect(0, 0, ctx.bitmap.width, ctx.bitmap.height, rgba(0, 0, 0, 0))
+  ctx.withCommandWriter w:
+    w.swrite(pcClearRect)
+    w.swrite(x1)
+    w.swrite(y1)
+    w.swrite(x2)
+    w.swrite(y2)
 
 proc clear(ctx: CanvasRenderingContext2D) =
   ctx.clearRect(0, 0, ctx.bitmap.width, ctx.bitmap.height)
 
+# Terminate the current frame of each canvas that has been drawn to since
+# the last call. The canvas renderer only outputs complete frames, so this
+# should be called once all scripts of an event loop iteration have run.
+# The frame reaches the bitmap once the renderer has drawn it.
+proc flushCanvasFrames*(window: Window) =
+  for ctx in window.canvasCtls:
+    if ctx.frameDirty:
+      ctx.ps.withPacketWriter w:
+        w.swrite(pcFrame)
+      ctx.frameDirty = false
+
 # CanvasState
 proc save(ctx: CanvasRenderingContext2D) {.jsfunc.} =
   ctx.stateStack.add(ctx.state)
@@ -1103,6 +1289,27 @@ func escapeText(s: string; attribute_mode = false): string =
     else:
       result &= c
 
+# The next sibling is read before yielding, so the loop body may remove the
+# current child.
+iterator childList*(node: Node): Node {.inline.} =
+  var child = node.firstChild
+  while child != nil:
+    let next = child.nextSibling
+    yield child
+    child = next
+
+iterator childList_rev*(node: Node): Node {.inline.} =
+  var child = node.lastChild
+  while child != nil:
+    let prev = child.previousSibling
+    yield child
+    child = prev
+
+func childList*(node: Node): seq[Node] =
+  result = @[]
+  for child in node.childList:
+    result.add(child)
+
 func `$`*(node: Node): string =
   # Note: this function should only be used for debugging.
   if node == nil:
@@ -1146,8 +1353,7 @@ iterator elementList*(node: Node): Element {.inline.} =
       yield Element(child)
 
 iterator elementList_rev*(node: Node): Element {.inline.} =
-  for i in countdown(node.childList.high, 0):
-    let child = node.childList[i]
+  for child in node.childList_rev:
     if child of Element:
       yield Element(child)
 
@@ -1174,13 +1380,13 @@ iterator branch*(node: Node): Node {.inline.} =
 # Returns the node's descendants
 iterator descendants*(node: Node): Node {.inline.} =
   var stack: seq[Node]
-  for i in countdown(node.childList.high, 0):
-    stack.add(node.childList[i])
+  for child in node.childList_rev:
+    stack.add(child)
   while stack.len > 0:
     let node = stack.pop()
     yield node
-    for i in countdown(node.childList.high, 0):
-      stack.add(node.childList[i])
+    for child in node.childList_rev:
+      stack.add(child)
 
 iterator elements*(node: Node): Element {.inline.} =
   for child in node.descendants:
@@ -1235,9 +1441,6 @@ iterator options*(select: HTMLSelectElement): HTMLOptionElement {.inline.} =
         if opt of HTMLOptionElement:
           yield HTMLOptionElement(opt)
 
-func id(collection: Collection): pointer =
-  return cast[pointer](collection)
-
 proc populateCollection(collection: Collection) =
   if collection.childonly:
     for child in collection.root.childList:
@@ -1247,36 +1450,12 @@ proc populateCollection(collection: Collection) =
     for desc in collection.root.descendants:
       if collection.match == nil or collection.match(desc):
         collection.snapshot.add(desc)
-  if collection.islive:
-    for child in collection.snapshot:
-      child.liveCollections.incl(collection.id)
-    collection.root.liveCollections.incl(collection.id)
+  collection.gen = collection.root.subtreeGen
 
 proc refreshCollection(collection: Collection) =
-  let document = collection.root.document
-  if collection.id in document.invalidCollections:
-    for child in collection.snapshot:
-      assert collection.id in child.liveCollections
-      child.liveCollections.excl(collection.id)
+  if collection.islive and collection.gen != collection.root.subtreeGen:
     collection.snapshot.setLen(0)
     collection.populateCollection()
-    document.invalidCollections.excl(collection.id)
-
-proc finalize0(collection: Collection) =
-  if collection.islive:
-    for child in collection.snapshot:
-      assert collection.id in child.liveCollections
-      child.liveCollections.excl(collection.id)
-    collection.root.document.invalidCollections.excl(collection.id)
-
-proc finalize(collection: HTMLCollection) {.jsfin.} =
-  collection.finalize0()
-
-proc finalize(collection: NodeList) {.jsfin.} =
-  collection.finalize0()
-
-proc finalize(collection: HTMLAllCollection) {.jsfin.} =
-  collection.finalize0()
 
 func ownerDocument(node: Node): Document {.jsfget.} =
   if node of Document:
@@ -1284,7 +1463,7 @@ func ownerDocument(node: Node): Document {.jsfget.} =
   return node.document
 
 func hasChildNodes(node: Node): bool {.jsfunc.} =
-  return node.childList.len > 0
+  return node.firstChild != nil
 
 func len(collection: Collection): int =
   collection.refreshCollection()
@@ -1575,6 +1754,7 @@ func item(collection: HTMLCollection; u: uint32): Element {.jsfunc.} =
   return nil
 
 func namedItem(collection: HTMLCollection; s: string): Element {.jsfunc.} =
+  collection.refreshCollection()
   let a = collection.root.document.toAtom(s)
   for it in collection.snapshot:
     let it = Element(it)
@@ -1830,7 +2010,6 @@ proc getAttr(map: NamedNodeMap; dataIdx: int): Attr =
     return map.attrlist[i]
   let attr = Attr(
     internalDocument: map.element.document,
-    index: -1,
     dataIdx: dataIdx,
     ownerElement: map.element
   )
@@ -1852,7 +2031,6 @@ func attributes(element: Element): NamedNodeMap {.jsfget.} =
   for i, attr in element.attrs:
     element.attributesInternal.attrlist.add(Attr(
       internalDocument: element.document,
-      index: -1,
       dataIdx: i,
       ownerElement: element
     ))
@@ -1949,6 +2127,10 @@ func names(ctx: JSContext; map: NamedNodeMap): JSPropertyEnumList
 func length(characterData: CharacterData): uint32 {.jsfget.} =
   return uint32(characterData.data.utf16Len)
 
+template appendData*(characterData: CharacterData; s: typed) =
+  characterData.data &= s
+  inc characterData.generation
+
 func tagName(element: Element): string {.jsfget.} =
   if element.namespace == Namespace.HTML:
     return element.document.toStr(element.localName).toUpperAscii()
@@ -2085,18 +2267,6 @@ func hasChildExcept(node: Node; nodeType: type; ex: Node): bool =
       return true
   return false
 
-func previousSibling*(node: Node): Node {.jsfget.} =
-  let i = node.index - 1
-  if node.parentNode == nil or i < 0:
-    return nil
-  return node.parentNode.childList[i]
-
-func nextSibling*(node: Node): Node {.jsfget.} =
-  let i = node.index + 1
-  if node.parentNode == nil or i >= node.parentNode.childList.len:
-    return nil
-  return node.parentNode.childList[i]
-
 func hasNextSibling(node: Node; nodeType: type): bool =
   var node = node.nextSibling
   while node != nil:
@@ -2159,16 +2329,6 @@ func contains*(a, b: Node): bool {.jsfunc.} =
         return true
   return false
 
-func firstChild*(node: Node): Node {.jsfget.} =
-  if node.childList.len == 0:
-    return nil
-  return node.childList[0]
-
-func lastChild*(node: Node): Node {.jsfget.} =
-  if node.childList.len == 0:
-    return nil
-  return node.childList[^1]
-
 func firstElementChild*(node: Node): Element {.jsfget.} =
   for child in node.elementList:
     return child
@@ -2185,13 +2345,44 @@ func findAncestor*(node: Node; tagTypes: set[TagType]): Element =
       return element
   return nil
 
+proc addId(document: Document; element: Element) =
+  document.idMap.mgetOrPut(element.id, @[]).add(element)
+
+proc removeId(document: Document; element: Element) =
+  var elements: seq[Element]
+  if document.idMap.pop(element.id, elements):
+    let i = elements.find(element)
+    if i != -1:
+      elements.del(i)
+    if elements.len > 0:
+      document.idMap[element.id] = move(elements)
+
+# Add the elements of a subtree that has just been connected to the ID map,
+# or remove them if it is about to be disconnected.
+proc updateIds(node: Node; add: bool) =
+  let document = node.document
+  template update(element: Element) =
+    if element.id != CAtomNull:
+      if add:
+        document.addId(element)
+      else:
+        document.removeId(element)
+  if node of Element:
+    update(Element(node))
+  for element in node.elements:
+    update(element)
+
 func getElementById(document: Document; id: string): Element {.jsfunc.} =
   if id.len == 0:
     return nil
   let id = document.toAtom(id)
-  for child in document.elements:
-    if child.id == id:
-      return child
+  document.idMap.withValue(id, elements):
+    if elements[].len == 1:
+      return elements[][0]
+    # Several elements share the ID; return the first one in tree order.
+    for child in document.elements:
+      if child.id == id:
+        return child
   return nil
 
 func getElementsByTagName0(root: Node; tagName: string): HTMLCollection =
@@ -2265,21 +2456,19 @@ func getElementsByClassName(element: Element; classNames: string):
   return element.getElementsByClassName0(classNames)
 
 func previousElementSibling*(elem: Element): Element {.jsfget.} =
-  let p = elem.parentNode
-  if p == nil: return nil
-  for i in countdown(elem.index - 1, 0):
-    let node = p.childList[i]
+  var node = elem.previousSibling
+  while node != nil:
     if node of Element:
       return Element(node)
+    node = node.previousSibling
   return nil
 
 func nextElementSibling*(elem: Element): Element {.jsfget.} =
-  let p = elem.parentNode
-  if p == nil: return nil
-  for i in elem.index + 1 .. p.childList.high:
-    let node = p.childList[i]
+  var node = elem.nextSibling
+  while node != nil:
     if node of Element:
       return Element(node)
+    node = node.nextSibling
   return nil
 
 func documentElement(document: Document): Element {.jsfget.} =
@@ -2736,8 +2925,7 @@ func getSrc*(this: HTMLElement): string =
 func newText*(document: Document; data: string): Text =
   return Text(
     internalDocument: document,
-    data: data,
-    index: -1
+    data: data
   )
 
 func newText(ctx: JSContext; data = ""): Text {.jsctor.} =
@@ -2747,8 +2935,7 @@ func newText(ctx: JSContext; data = ""): Text {.jsctor.} =
 func newCDATASection(document: Document; data: string): CDATASection =
   return CDATASection(
     internalDocument: document,
-    data: data,
-    index: -1
+    data: data
   )
 
 func newProcessingInstruction(document: Document; target, data: string):
@@ -2756,12 +2943,11 @@ func newProcessingInstruction(document: Document; target, data: string):
   return ProcessingInstruction(
     internalDocument: document,
     target: target,
-    data: data,
-    index: -1
+    data: data
   )
 
 func newDocumentFragment(document: Document): DocumentFragment =
-  return DocumentFragment(internalDocument: document, index: -1)
+  return DocumentFragment(internalDocument: document)
 
 func newDocumentFragment(ctx: JSContext): DocumentFragment {.jsctor.} =
   let window = ctx.getGlobal()
@@ -2770,8 +2956,7 @@ func newDocumentFragment(ctx: JSContext): DocumentFragment {.jsctor.} =
 func newComment(document: Document; data: string): Comment =
   return Comment(
     internalDocument: document,
-    data: data,
-    index: -1
+    data: data
   )
 
 func newComment(ctx: JSContext; data: string = ""): Comment {.jsctor.} =
@@ -2842,6 +3027,7 @@ proc newHTMLElement*(document: Document; localName: CAtom;
     let bitmap = if document.scriptingEnabled:
       NetworkBitmap(
         contentType: "image/x-cha-canvas",
+        cacheId: -1,
         imageId: document.window.getImageId(),
         width: 300,
         height: 150
@@ -2868,7 +3054,6 @@ proc newHTMLElement*(document: Document; localName: CAtom;
   result.internalDocument = document
   let localName = document.toAtom(satClassList)
   result.classList = DOMTokenList(element: result, localName: localName)
-  result.index = -1
   result.dataset = DOMStringMap(target: result)
 
 proc newHTMLElement*(document: Document; tagType: TagType): HTMLElement =
@@ -2879,7 +3064,6 @@ func newDocument*(factory: CAtomFactory): Document =
   assert factory != nil
   let document = Document(
     url: newURL("about:blank").get,
-    index: -1,
     factory: factory
   )
   document.implementation = DOMImplementation(document: document)
@@ -2895,8 +3079,7 @@ func newDocumentType*(document: Document; name, publicId, systemId: string):
     internalDocument: document,
     name: name,
     publicId: publicId,
-    systemId: systemId,
-    index: -1
+    systemId: systemId
   )
 
 func isHostIncludingInclusiveAncestor*(a, b: Node): bool =
@@ -2962,8 +3145,10 @@ func value*(option: HTMLOptionElement): string {.jsfget.} =
   return option.text
 
 proc invalidateCollections(node: Node) =
-  for id in node.liveCollections:
-    node.document.invalidCollections.incl(id)
+  var node = node
+  while node != nil:
+    inc node.subtreeGen
+    node = node.parentNode
 
 proc setInvalid*(element: Element) =
   element.invalid = true
@@ -2988,13 +3173,11 @@ proc delAttr(element: Element; i: int; keep = false) =
         let data = attr.data
         attr.ownerElement = AttrDummyElement(
           internalDocument: attr.ownerElement.document,
-          index: -1,
           attrs: @[data]
         )
         attr.dataIdx = 0
       map.attrlist.del(j) # ordering does not matter
   element.reflectAttr(name, none(string))
-  element.invalidateCollections()
   element.setInvalid()
 
 proc newCSSStyleDeclaration(element: Element; value: string):
@@ -3250,6 +3433,7 @@ proc reflectEvent(element: Element; target: EventTarget; name, ctype: StaticAtom
   JS_FreeValue(ctx, fun)
 
 proc reflectAttr(element: Element; name: CAtom; value: Option[string]) =
+  element.invalidateCollections()
   let name = element.document.toStaticAtom(name)
   template reflect_str(element: Element; n: StaticAtom; val: untyped) =
     if name == n:
@@ -3278,7 +3462,17 @@ proc reflectAttr(element: Element; name: CAtom; value: Option[string]) =
     if name == n:
       element.reflect_domtoklist0 val
       return
-  element.reflect_atom satId, id
+  if name == satId:
+    let connected = element.isConnected
+    if connected and element.id != CAtomNull:
+      element.document.removeId(element)
+    element.id = if value.isSome:
+      element.document.toAtom(value.get)
+    else:
+      CAtomNull
+    if connected and element.id != CAtomNull:
+      element.document.addId(element)
+    return
   element.reflect_atom satName, name
   element.reflect_domtoklist satClass, classList
   #TODO internalNonce
@@ -3339,12 +3533,16 @@ proc reflectAttr(element: Element; name: CAtom; value: Option[string]) =
             canvas.bitmap.height != h:
           let window = element.document.window
           if canvas.ctx2d != nil and canvas.ctx2d.ps != nil:
-            let i = window.pendingCanvasCtls.find(canvas.ctx2d)
-            window.pendingCanvasCtls.del(i)
+            let i = window.canvasCtls.find(canvas.ctx2d)
+            window.canvasCtls.del(i)
             canvas.ctx2d.ps.sclose()
+            canvas.ctx2d.ps = nil
             canvas.ctx2d = nil
+          if canvas.bitmap != nil and canvas.bitmap.cacheId != -1:
+            window.loader.removeCachedItem(canvas.bitmap.cacheId)
           canvas.bitmap = NetworkBitmap(
             contentType: "image/x-cha-canvas",
+            cacheId: -1,
             imageId: window.getImageId(),
             width: w,
             height: h
@@ -3376,7 +3574,6 @@ proc attr*(element: Element; name: CAtom; value: string) =
   let i = element.findAttrOrNext(name)
   if i >= 0:
     element.attrs[i].value = value
-    element.invalidateCollections()
     element.setInvalid()
   else:
     element.attrs.insert(AttrData(
@@ -3407,7 +3604,6 @@ proc attrns*(element: Element; localName: CAtom; prefix: NamespacePrefix;
     element.attrs[i].prefix = prefixAtom
     element.attrs[i].qualifiedName = qualifiedName
     element.attrs[i].value = value
-    element.invalidateCollections()
     element.setInvalid()
   else:
     element.attrs.insert(AttrData(
@@ -3541,22 +3737,27 @@ proc removeNamedItemNS(map: NamedNodeMap; namespace, localName: string):
 proc jsId(element: Element; id: string) {.jsfset: "id".} =
   element.attr(satId, id)
 
-# Pass an index to avoid searching for the node in parent's child list.
 proc remove*(node: Node; suppressObservers: bool) =
   let parent = node.parentNode
   assert parent != nil
-  assert node.index != -1
+  if node.isConnected:
+    node.updateIds(add = false)
   #TODO live ranges
   #TODO NodeIterator
-  for i in node.index ..< parent.childList.len - 1:
-    parent.childList[i] = parent.childList[i + 1]
-    parent.childList[i].index = i
-  parent.childList.setLen(parent.childList.len - 1)
+  if node.previousSibling != nil:
+    node.previousSibling.nextSibling = node.nextSibling
+  else:
+    parent.firstChild = node.nextSibling
+  if node.nextSibling != nil:
+    node.nextSibling.previousSibling = node.previousSibling
+  else:
+    parent.lastChild = node.previousSibling
   parent.invalidateCollections()
   if parent of Element:
     Element(parent).setInvalid()
   node.parentNode = nil
-  node.index = -1
+  node.previousSibling = nil
+  node.nextSibling = nil
   if node.document != nil and (node of HTMLStyleElement or
       node of HTMLLinkElement):
     node.document.cachedSheetsInvalid = true
@@ -3574,11 +3775,14 @@ proc adopt(document: Document; node: Node) =
     remove(node)
   if oldDocument != document:
     #TODO shadow root
-    for desc in node.descendants:
-      desc.internalDocument = document
-      if desc of Element:
-        for attr in Element(desc).attributes.attrlist:
+    template setDocument(it: Node) =
+      it.internalDocument = document
+      if it of Element:
+        for attr in Element(it).attributes.attrlist:
           attr.internalDocument = document
+    setDocument(node)
+    for desc in node.descendants:
+      setDocument(desc)
     #TODO custom elements
     #..adopting steps
 
@@ -3751,17 +3955,20 @@ func preInsertionValidity*(parent, node, before: Node): Err[DOMException] =
 
 proc insertNode(parent, node, before: Node) =
   parent.document.adopt(node)
-  parent.childList.setLen(parent.childList.len + 1)
-  if before == nil:
-    node.index = parent.childList.high
+  let prev = if before == nil: parent.lastChild else: before.previousSibling
+  node.previousSibling = prev
+  node.nextSibling = before
+  if prev != nil:
+    prev.nextSibling = node
   else:
-    node.index = before.index
-    for i in countdown(parent.childList.high - 1, node.index):
-      parent.childList[i + 1] = parent.childList[i]
-      parent.childList[i + 1].index = i + 1
-  parent.childList[node.index] = node
+    parent.firstChild = node
+  if before != nil:
+    before.previousSibling = node
+  else:
+    parent.lastChild = node
   node.parentNode = parent
-  node.invalidateCollections()
+  if parent.isConnected:
+    node.updateIds(add = true)
   parent.invalidateCollections()
   if node.document != nil and (node of HTMLStyleElement or
       node of HTMLLinkElement):
@@ -3780,8 +3987,8 @@ proc insert*(parent, node, before: Node; suppressObservers = false) =
   if count == 0:
     return
   if node of DocumentFragment:
-    for i in countdown(node.childList.high, 0):
-      node.childList[i].remove(true)
+    for child in node.childList_rev:
+      child.remove(true)
     #TODO tree mutation record
   if before != nil:
     #TODO live ranges
@@ -3892,7 +4099,9 @@ proc textContent*(node: Node; data: Option[string]) {.jsfset.} =
       nil
     node.replaceAll(x)
   elif node of CharacterData:
-    CharacterData(node).data = data.get("")
+    let node = CharacterData(node)
+    node.data = data.get("")
+    inc node.generation
   elif node of Attr:
     value(Attr(node), data.get(""))
 
@@ -4319,7 +4528,6 @@ proc clone(node: Node; document = none(Document), deep = false): Node =
     let x = Attr(
       ownerElement: AttrDummyElement(
         internalDocument: attr.ownerElement.document,
-        index: -1,
         attrs: @[data]
       ),
       dataIdx: 0
@@ -4377,8 +4585,6 @@ func equals(a, b: AttrData): bool =
     a.value == b.value
 
 func isEqualNode(node, other: Node): bool {.jsfunc.} =
-  if node.childList.len != other.childList.len:
-    return false
   if node of DocumentType:
     if not (other of DocumentType):
       return false
@@ -4417,10 +4623,14 @@ func isEqualNode(node, other: Node): bool {.jsfunc.} =
         node of Comment and not (other of Comment):
       return false
     return CharacterData(node).data == CharacterData(other).data
-  for i, child in node.childList:
-    if not child.isEqualNode(other.childList[i]):
+  var child = node.firstChild
+  var otherChild = other.firstChild
+  while child != nil and otherChild != nil:
+    if not child.isEqualNode(otherChild):
       return false
-  true
+    child = child.nextSibling
+    otherChild = otherChild.nextSibling
+  return child == nil and otherChild == nil
 
 func isSameNode(node, other: Node): bool {.jsfunc.} =
   return node == other
@@ -4567,7 +4777,7 @@ proc getContext*(jctx: JSContext; this: HTMLCanvasElement; contextId: string;
 # backwards compat, but I don't care.
 proc toBlob(ctx: JSContext; this: HTMLCanvasElement; callback: JSValue;
     contentType = "image/png"; quality = none(float64)) {.jsfunc.} =
-  if not contentType.startsWith("image/") or this.bitmap.cacheId == 0:
+  if not contentType.startsWith("image/") or this.bitmap.cacheId == -1:
     return
   let url0 = newURL("img-codec+" & contentType.after('/') & ":encode")
   if url0.isNone:
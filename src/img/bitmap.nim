@@ -12,6 +12,8 @@ type
     cacheId*: int
     imageId*: int
     contentType*: string
+    # Number of complete frames; only changes for canvases.
+    frame*: int
 
 proc newBitmap*(width, height: int): ImageBitmap =
   return ImageBitmap(
@@ -37,3 +39,46 @@ proc setpxb*(bmp: Bitmap; x, y: int; c: RGBAColorBE) {.inline.} =
 
 proc setpxb*(bmp: Bitmap; x, y: int; c: ARGBColor) {.inline.} =
   bmp.setpxb(x, y, rgba_be(c.r, c.g, c.b, c.a))
+
+# Row kernels; these have SIMD implementations on x86.
+{.compile: "span.c".}
+proc cha_span_fill(dst: ptr RGBAColorBE; c: uint32; n: csize_t)
+  {.importc, cdecl.}
+proc cha_span_blend_color(dst: ptr RGBAColorBE; c: uint32; n: csize_t)
+  {.importc, cdecl.}
+proc cha_span_blend(dst, src: ptr RGBAColorBE; n: csize_t) {.importc, cdecl.}
+
+# Fill the pixels x1 ..< x2 of row y with c, clipped to the bitmap.
+proc fillSpan*(bmp: Bitmap; x1, x2, y: int; c: RGBAColorBE) =
+  let x1 = max(x1, 0)
+  let x2 = min(x2, bmp.width)
+  if x1 < x2 and y >= 0 and y < bmp.height:
+    cha_span_fill(addr bmp.px[bmp.width * y + x1], cast[uint32](c),
+      csize_t(x2 - x1))
+
+# Blend c onto the pixels x1 ..< x2 of row y, clipped to the bitmap.
+proc blendSpan*(bmp: Bitmap; x1, x2, y: int; c: RGBAColorBE) =
+  let x1 = max(x1, 0)
+  let x2 = min(x2, bmp.width)
+  if x1 < x2 and y >= 0 and y < bmp.height:
+    cha_span_blend_color(addr bmp.px[bmp.width * y + x1], cast[uint32](c),
+      csize_t(x2 - x1))
+
+proc blendSpan*(bmp: Bitmap; x1, x2, y: int; c: ARGBColor) {.inline.} =
+  bmp.blendSpan(x1, x2, y, rgba_be(c.r, c.g, c.b, c.a))
+
+# Blend w pixels of row sy of src starting at sx onto row y of bmp starting
+# at x, clipped to both bitmaps.
+proc blendSpan*(bmp: Bitmap; x, y: int; src: Bitmap; sx, sy, w: int) =
+  if y < 0 or y >= bmp.height or sy < 0 or sy >= src.height:
+    return
+  var x = x
+  var sx = sx
+  var w = w
+  let d = max(max(-x, -sx), 0)
+  x += d
+  sx += d
+  w = min(w - d, min(bmp.width - x, src.width - sx))
+  if w > 0:
+    cha_span_blend(addr bmp.px[bmp.width * y + x],
+      addr src.px[src.width * sy + sx], csize_t(w))
@@ -1,4 +1,5 @@
 import std/algorithm
+import std/bitops
 
 import img/bitmap
 import img/path
@@ -13,8 +14,8 @@ type
     cfrEvenOdd = "evenodd"
 
   PaintCommand* = enum
-    pcSetDimensions, pcFillRect, pcStrokeRect, pcFillPath, pcStrokePath,
-    pcFillText, pcStrokeText
+    pcSetDimensions, pcClearRect, pcFillRect, pcStrokeRect, pcFillPath,
+    pcStrokePath, pcFillText, pcStrokeText, pcFrame, pcDrawImage
 
   CanvasTextAlign* = enum
     ctaStart = "start"
@@ -109,10 +110,8 @@ proc fillPath*(bmp: Bitmap; lines: PathLines; color: ARGBColor;
       let b = ylines[k + 1]
       let sx = int(a.minyx)
       let ex = int(b.minyx)
-      if w.isInside(fillRule) and y > 0:
-        for x in sx .. ex:
-          if x > 0:
-            bmp.setpxb(x, y, color)
+      if w.isInside(fillRule):
+        bmp.blendSpan(sx, ex + 1, y, color)
       if int(a.p0.y) != y and int(a.p1.y) != y and int(b.p0.y) != y and
           int(b.p1.y) != y and sx != ex or a.islope * b.islope < 0:
         case fillRule
@@ -126,73 +125,81 @@ proc fillPath*(bmp: Bitmap; lines: PathLines; color: ARGBColor;
     if ylines.len > 0:
       ylines[^1].minyx += ylines[^1].islope
 
+proc clearRect*(bmp: Bitmap; x1, y1, x2, y2: int) =
+  for y in max(y1, 0) ..< min(y2, bmp.height):
+    bmp.fillSpan(x1, x2, y, rgba_be(0, 0, 0, 0))
+
 proc fillRect*(bmp: Bitmap; x1, y1, x2, y2: int; color: ARGBColor) =
-  for y in y1 ..< y2:
-    for x in x1 ..< x2:
-      bmp.setpxb(x, y, color)
+  for y in max(y1, 0) ..< min(y2, bmp.height):
+    bmp.blendSpan(x1, x2, y, color)
 
 proc strokeRect*(bmp: Bitmap; x1, y1, x2, y2: int; color: ARGBColor) =
-  for x in x1 ..< x2:
-    bmp.setpxb(x, y1, color)
-    bmp.setpxb(x, y2, color)
-  for y in y1 ..< y2:
-    bmp.setpxb(x1, y, color)
-    bmp.setpxb(x2, y, color)
-
-type GlyphCacheItem = object
-  u: uint32
-  bmp: Bitmap
-
-var unifontBitmap*: Bitmap = nil
-var glyphCache: seq[GlyphCacheItem] = @[]
-var glyphCacheI = 0
-proc getCharBmp(u: uint32): Bitmap =
-  # We only have the BMP.
-  let u = if u <= 0xFFFF: u else: 0xFFFD
-  for it in glyphCache:
-    if it.u == u:
-      return it.bmp
-  # Unifont glyphs start at x: 32, y: 64, and are of 8x16/16x16 size
-  let gx = int(32 + 16 * (u mod 0x100))
-  let gy = int(64 + 16 * (u div 0x100))
-  var fullwidth = false
-  const white = rgba_be(255, 255, 255, 255)
-  block loop:
-    # hack to recognize full width characters
-    for y in 0 ..< 16:
-      for x in 8 ..< 16:
-        if unifontBitmap.getpx(gx + x, gy + y) != white:
-          fullwidth = true
-          break loop
-  let bmp = newBitmap(if fullwidth: 16 else: 8, 16)
-  for y in 0 ..< bmp.height:
-    for x in 0 ..< bmp.width:
-      let c = unifontBitmap.getpx(gx + x, gy + y)
-      if c != white:
-        bmp.setpx(x, y, c)
-  if glyphCache.len < 256:
-    glyphCache.add(GlyphCacheItem(u: u, bmp: bmp))
-  else:
-    glyphCache[glyphCacheI] = GlyphCacheItem(u: u, bmp: bmp)
-    inc glyphCacheI
-    if glyphCacheI >= glyphCache.len:
-      glyphCacheI = 0
-  return bmp
-
-proc drawBitmap(a, b: Bitmap; p: Vector2D) =
-  for y in 0 ..< b.height:
-    for x in 0 ..< b.width:
-      let ax = int(p.x) + x
-      let ay = int(p.y) + y
-      if ax >= 0 and ay >= y and ax < a.width and ay < a.height:
-        a.setpxb(ax, ay, b.getpx(x, y))
+  bmp.blendSpan(x1, x2, y1, color)
+  bmp.blendSpan(x1, x2, y2, color)
+  for y in max(y1, 0) ..< min(y2, bmp.height):
+    bmp.blendSpan(x1, x1 + 1, y, color)
+    bmp.blendSpan(x2, x2 + 1, y, color)
+
+# Packed 1bpp unifont glyphs; see res/genunifont.nim for the format.
+# Only the BMP is covered.
+const unifont = staticRead"res/map/unifont_gen.bin"
+const unifontWidthsLen = 0x10000 div 8
+const unifontDataStart = unifontWidthsLen + unifontWidthsLen * 4
+
+func unifontByte(i: int): uint8 {.inline.} =
+  return uint8(unifont[i])
+
+type Glyph = object
+  offset: int # start of the glyph's rows in unifont
+  width: int
+
+func getGlyph(u: uint32): Glyph =
+  let u = if u <= 0xFFFF: int(u) else: 0xFFFD
+  let i = u shr 3
+  let n = u and 7
+  let widths = unifontByte(i)
+  let fullwidth = (widths and (1u8 shl n)) != 0
+  let gi = unifontWidthsLen + i * 4
+  let groupOffset = int(unifontByte(gi)) or
+    int(unifontByte(gi + 1)) shl 8 or
+    int(unifontByte(gi + 2)) shl 16 or
+    int(unifontByte(gi + 3)) shl 24
+  let prevFull = countSetBits(widths and ((1u8 shl n) - 1))
+  return Glyph(
+    offset: unifontDataStart + groupOffset + 16 * (n + prevFull),
+    width: if fullwidth: 16 else: 8
+  )
+
+proc drawGlyph(bmp: Bitmap; glyph: Glyph; x, y: int; color: ARGBColor) =
+  let bw = glyph.width div 8
+  for gy in 0 ..< 16:
+    let py = y + gy
+    if py < 0:
+      continue
+    if py >= bmp.height:
+      break
+    var row = 0u32
+    for i in 0 ..< bw:
+      row = (row shl 8) or uint32(unifontByte(glyph.offset + gy * bw + i))
+    # blend each run of set bits as a span
+    var gx = 0
+    while row != 0:
+      let n = countLeadingZeroBits(row) - (32 - glyph.width)
+      row = row shl n
+      gx += n
+      var m = 0
+      while (row and (1u32 shl (glyph.width - 1))) != 0:
+        row = (row shl 1) and ((1u32 shl glyph.width) - 1)
+        inc m
+      bmp.blendSpan(x + gx, x + gx + m, py, color)
+      gx += m
 
 proc fillText*(bmp: Bitmap; text: string; x, y: float64; color: ARGBColor;
     textAlign: CanvasTextAlign) =
   var w = 0f64
-  var glyphs: seq[Bitmap] = @[]
+  var glyphs: seq[Glyph] = @[]
   for u in text.points:
-    let glyph = getCharBmp(u)
+    let glyph = getGlyph(u)
     glyphs.add(glyph)
     w += float64(glyph.width)
   var x = x
@@ -202,7 +209,7 @@ proc fillText*(bmp: Bitmap; text: string; x, y: float64; color: ARGBColor;
   of ctaRight, ctaEnd: x -= w
   of ctaCenter: x -= w / 2
   for glyph in glyphs:
-    bmp.drawBitmap(glyph, Vector2D(x: x, y: y - 8))
+    bmp.drawGlyph(glyph, int(x), int(y) - 8, color)
     x += float64(glyph.width)
 
 proc strokeText*(bmp: Bitmap; text: string; x, y: float64; color: ARGBColor;
@@ -0,0 +1,396 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Row kernels for Bitmap.
+ *
+ * Pixels are RGBAColorBE, i.e. bytes in R, G, B, A order with straight
+ * (non-premultiplied) alpha. Blending is source-over, and produces the
+ * same result as blend() in types/color.nim. (Except that blending a
+ * fully transparent color, or onto a fully transparent pixel, skips the
+ * round trip through premultiplication; the result is then exactly the
+ * destination or the source respectively.)
+ *
+ * The SIMD paths only handle opaque destination pixels (which is what
+ * canvas and image compositing mostly deals with); there the result is
+ * simply s * a / 255 + d * (255 - a) / 255 per channel, which fits into
+ * 16-bit lanes. Other pixels go through the scalar path. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	!defined(CHA_SPAN_NO_SIMD)
+#define CHA_SPAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* Pixels are handled as native-endian uint32_t loads of the RGBAColorBE
+ * bytes, so the alpha byte is the top byte on little-endian targets. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ASHIFT 0
+#else
+#define ASHIFT 24
+#endif
+
+#define ALPHA(c) (((c) >> ASHIFT) & 0xFF)
+#define CH(c, i) (((c) >> (i)) & 0xFF)
+
+/* Divide by 255 with rounding; exact for x <= 255 * 255. */
+static inline uint32_t div255(uint32_t x)
+{
+	x += 0x80;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t premul(uint32_t c)
+{
+	uint32_t a = ALPHA(c);
+	uint32_t r = a << ASHIFT;
+	int i;
+
+	for (i = 0; i < 32; i += 8)
+		if (i != ASHIFT)
+			r |= div255(CH(c, i) * a) << i;
+	return r;
+}
+
+static inline uint32_t straight(uint32_t c)
+{
+	uint32_t a = ALPHA(c);
+	uint32_t r = a << ASHIFT;
+	int i;
+
+	if (a == 0)
+		return 0;
+	for (i = 0; i < 32; i += 8)
+		if (i != ASHIFT)
+			r |= (((CH(c, i) * 0xFF00) / a + 0x80) >> 8 & 0xFF) << i;
+	return r;
+}
+
+/* Same as blend() in types/color.nim. */
+static inline uint32_t blend1(uint32_t d, uint32_t s)
+{
+	uint32_t pd = premul(d);
+	uint32_t ps = premul(s);
+	uint32_t k = 255 - ALPHA(ps);
+	uint32_t r = 0;
+	int i;
+
+	for (i = 0; i < 32; i += 8)
+		r |= ((CH(ps, i) + div255(CH(pd, i) * k)) & 0xFF) << i;
+	return straight(r);
+}
+
+/* blend1 for an opaque d. */
+static inline uint32_t blend1_opaque(uint32_t d, uint32_t s)
+{
+	uint32_t a = ALPHA(s);
+	uint32_t k = 255 - a;
+	uint32_t r = 0xFFu << ASHIFT;
+	int i;
+
+	for (i = 0; i < 32; i += 8)
+		if (i != ASHIFT)
+			r |= (div255(CH(s, i) * a) + div255(CH(d, i) * k)) << i;
+	return r;
+}
+
+static inline uint32_t blend_px(uint32_t d, uint32_t s)
+{
+	if (ALPHA(s) == 255 || ALPHA(d) == 0)
+		return s;
+	if (ALPHA(d) == 255)
+		return blend1_opaque(d, s);
+	return blend1(d, s);
+}
+
+static void fill_scalar(uint32_t *dst, uint32_t c, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = c;
+}
+
+static void blend_color_scalar(uint32_t *dst, uint32_t c, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = blend_px(dst[i], c);
+}
+
+static void blend_scalar(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = blend_px(dst[i], src[i]);
+}
+
+#ifdef CHA_SPAN_X86
+
+/* 16-bit lane version of div255. */
+#define DIV255_EPI16(x) \
+	_mm_srli_epi16(_mm_add_epi16((x), _mm_srli_epi16((x), 8)), 8)
+#define DIV255_EPI16_256(x) \
+	_mm256_srli_epi16(_mm256_add_epi16((x), _mm256_srli_epi16((x), 8)), 8)
+
+/* Blend s over d for 2 opaque pixels unpacked to 16-bit lanes.
+ * a is s's alpha broadcast to all lanes of the respective pixel. */
+__attribute__((target("sse2")))
+static inline __m128i blend_lo_sse2(__m128i d, __m128i s, __m128i a)
+{
+	const __m128i h = _mm_set1_epi16(0x80);
+	const __m128i ff = _mm_set1_epi16(0xFF);
+	__m128i sa = _mm_add_epi16(_mm_mullo_epi16(s, a), h);
+	__m128i dk = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(ff, a)),
+		h);
+
+	return _mm_add_epi16(DIV255_EPI16(sa), DIV255_EPI16(dk));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i alpha_lanes_sse2(__m128i s16)
+{
+	/* broadcast lane 3 to lanes 0-3 and lane 7 to lanes 4-7 */
+	s16 = _mm_shufflelo_epi16(s16, _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm_shufflehi_epi16(s16, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+/* Blend 4 source pixels over 4 opaque destination pixels. */
+__attribute__((target("sse2")))
+static inline __m128i blend4_sse2(__m128i d, __m128i s)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i amask = _mm_set1_epi32((int)0xFF000000u);
+	__m128i slo = _mm_unpacklo_epi8(s, z);
+	__m128i shi = _mm_unpackhi_epi8(s, z);
+	__m128i lo = blend_lo_sse2(_mm_unpacklo_epi8(d, z), slo,
+		alpha_lanes_sse2(slo));
+	__m128i hi = blend_lo_sse2(_mm_unpackhi_epi8(d, z), shi,
+		alpha_lanes_sse2(shi));
+
+	return _mm_or_si128(_mm_packus_epi16(lo, hi), amask);
+}
+
+__attribute__((target("sse2")))
+static int opaque4_sse2(__m128i d)
+{
+	const __m128i amask = _mm_set1_epi32((int)0xFF000000u);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(d, amask),
+		amask)) == 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint32_t *dst, uint32_t c, size_t n)
+{
+	__m128i v = _mm_set1_epi32((int)c);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	fill_scalar(dst + i, c, n - i);
+}
+
+__attribute__((target("sse2")))
+static void blend_color_sse2(uint32_t *dst, uint32_t c, size_t n)
+{
+	__m128i s = _mm_set1_epi32((int)c);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+
+		if (opaque4_sse2(d))
+			_mm_storeu_si128((__m128i *)(dst + i), blend4_sse2(d, s));
+		else
+			blend_color_scalar(dst + i, c, 4);
+	}
+	blend_color_scalar(dst + i, c, n - i);
+}
+
+__attribute__((target("sse2")))
+static void blend_sse2(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+
+		if (opaque4_sse2(d))
+			_mm_storeu_si128((__m128i *)(dst + i), blend4_sse2(d, s));
+		else
+			blend_scalar(dst + i, src + i, 4);
+	}
+	blend_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_lo_avx2(__m256i d, __m256i s, __m256i a)
+{
+	const __m256i h = _mm256_set1_epi16(0x80);
+	const __m256i ff = _mm256_set1_epi16(0xFF);
+	__m256i sa = _mm256_add_epi16(_mm256_mullo_epi16(s, a), h);
+	__m256i dk = _mm256_add_epi16(_mm256_mullo_epi16(d,
+		_mm256_sub_epi16(ff, a)), h);
+
+	return _mm256_add_epi16(DIV255_EPI16_256(sa), DIV255_EPI16_256(dk));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i alpha_lanes_avx2(__m256i s16)
+{
+	s16 = _mm256_shufflelo_epi16(s16, _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm256_shufflehi_epi16(s16, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+/* Blend 8 source pixels over 8 opaque destination pixels. (unpack and
+ * pack both work per 128-bit lane, so the pixel order is preserved.) */
+__attribute__((target("avx2")))
+static inline __m256i blend8_avx2(__m256i d, __m256i s)
+{
+	const __m256i z = _mm256_setzero_si256();
+	const __m256i amask = _mm256_set1_epi32((int)0xFF000000u);
+	__m256i slo = _mm256_unpacklo_epi8(s, z);
+	__m256i shi = _mm256_unpackhi_epi8(s, z);
+	__m256i lo = blend_lo_avx2(_mm256_unpacklo_epi8(d, z), slo,
+		alpha_lanes_avx2(slo));
+	__m256i hi = blend_lo_avx2(_mm256_unpackhi_epi8(d, z), shi,
+		alpha_lanes_avx2(shi));
+
+	return _mm256_or_si256(_mm256_packus_epi16(lo, hi), amask);
+}
+
+__attribute__((target("avx2")))
+static int opaque8_avx2(__m256i d)
+{
+	const __m256i amask = _mm256_set1_epi32((int)0xFF000000u);
+
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(d,
+		amask), amask)) == -1;
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint32_t *dst, uint32_t c, size_t n)
+{
+	__m256i v = _mm256_set1_epi32((int)c);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	fill_scalar(dst + i, c, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blend_color_avx2(uint32_t *dst, uint32_t c, size_t n)
+{
+	__m256i s = _mm256_set1_epi32((int)c);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+
+		if (opaque8_avx2(d))
+			_mm256_storeu_si256((__m256i *)(dst + i),
+				blend8_avx2(d, s));
+		else
+			blend_color_scalar(dst + i, c, 8);
+	}
+	blend_color_sse2(dst + i, c, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blend_avx2(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		if (opaque8_avx2(d))
+			_mm256_storeu_si256((__m256i *)(dst + i),
+				blend8_avx2(d, s));
+		else
+			blend_scalar(dst + i, src + i, 8);
+	}
+	blend_sse2(dst + i, src + i, n - i);
+}
+
+enum {
+	SPAN_UNKNOWN,
+	SPAN_SCALAR,
+	SPAN_SSE2,
+	SPAN_AVX2
+};
+
+static int span_impl = SPAN_UNKNOWN;
+
+static int get_span_impl(void)
+{
+	if (span_impl == SPAN_UNKNOWN) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			span_impl = SPAN_AVX2;
+		else if (__builtin_cpu_supports("sse2"))
+			span_impl = SPAN_SSE2;
+		else
+			span_impl = SPAN_SCALAR;
+	}
+	return span_impl;
+}
+
+#endif /* CHA_SPAN_X86 */
+
+void cha_span_fill(uint32_t *dst, uint32_t c, size_t n)
+{
+#ifdef CHA_SPAN_X86
+	switch (get_span_impl()) {
+	case SPAN_AVX2:
+		fill_avx2(dst, c, n);
+		return;
+	case SPAN_SSE2:
+		fill_sse2(dst, c, n);
+		return;
+	}
+#endif
+	fill_scalar(dst, c, n);
+}
+
+void cha_span_blend_color(uint32_t *dst, uint32_t c, size_t n)
+{
+	if (ALPHA(c) == 255) {
+		cha_span_fill(dst, c, n);
+		return;
+	}
+	if (ALPHA(c) == 0)
+		return;
+#ifdef CHA_SPAN_X86
+	switch (get_span_impl()) {
+	case SPAN_AVX2:
+		blend_color_avx2(dst, c, n);
+		return;
+	case SPAN_SSE2:
+		blend_color_sse2(dst, c, n);
+		return;
+	}
+#endif
+	blend_color_scalar(dst, c, n);
+}
+
+void cha_span_blend(uint32_t *dst, const uint32_t *src, size_t n)
+{
+#ifdef CHA_SPAN_X86
+	switch (get_span_impl()) {
+	case SPAN_AVX2:
+		blend_avx2(dst, src, n);
+		return;
+	case SPAN_SSE2:
+		blend_sse2(dst, src, n);
+		return;
+	}
+#endif
+	blend_scalar(dst, src, n);
+}
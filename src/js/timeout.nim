@@ -1,5 +1,12 @@
+# Timeouts and intervals are kept in a binary heap ordered by deadline, and
+# only the earliest deadline is armed in the selector. So there is at most one
+# timer fd per process, however many timers a page schedules.
+
+import std/heapqueue
+import std/monotimes
 import std/selectors
 import std/tables
+import std/times
 
 import io/dynstream
 import js/console
@@ -15,22 +22,37 @@ type
 
   TimeoutEntry = ref object
     t: TimeoutType
-    fd: int
+    interval: Duration
+    deadline: MonoTime
     val: JSValue
     args: seq[JSValue]
 
+  # Heap item. Entries that have been cleared are left in the heap, and
+  # skipped when they are popped.
+  TimeoutDeadline = object
+    deadline: MonoTime
+    id: int32
+
   TimeoutState* = ref object
     timeoutid: int32
     timeouts: Table[int32, TimeoutEntry]
-    timeoutFds: Table[int, int32]
+    heap: HeapQueue[TimeoutDeadline]
+    timerFd: int # -1 if not armed
+    armed: MonoTime # deadline timerFd was armed for
+    running: bool
     selector: Selector[int] #TODO would be better with void...
     jsctx: JSContext
     err: DynStream #TODO shouldn't be needed
     evalJSFree: proc(src, file: string) #TODO ew
 
+func `<`(a, b: TimeoutDeadline): bool =
+  # timers due at the same time run in the order they were set
+  return a.deadline < b.deadline or a.deadline == b.deadline and a.id < b.id
+
 func newTimeoutState*(selector: Selector[int]; jsctx: JSContext; err: DynStream;
     evalJSFree: proc(src, file: string)): TimeoutState =
   return TimeoutState(
+    timerFd: -1,
     selector: selector,
     jsctx: jsctx,
     err: err,
@@ -40,31 +62,74 @@ func newTimeoutState*(selector: Selector[int]; jsctx: JSContext; err: DynStream;
 func empty*(state: TimeoutState): bool =
   return state.timeouts.len == 0
 
+proc disarm(state: TimeoutState) =
+  if state.timerFd != -1:
+    state.selector.unregister(state.timerFd)
+    state.timerFd = -1
+
+# Drop cleared entries from the top of the heap, and rebuild it when most of
+# it is garbage (e.g. a debounce handler clearing and re-setting a timeout on
+# every keystroke).
+proc compact(state: TimeoutState) =
+  while state.heap.len > 0:
+    let it = state.heap[0]
+    let entry = state.timeouts.getOrDefault(it.id)
+    if entry != nil and entry.deadline == it.deadline:
+      break
+    discard state.heap.pop()
+  if state.heap.len > 64 and state.heap.len > state.timeouts.len * 2:
+    state.heap.clear()
+    for id, entry in state.timeouts:
+      state.heap.push(TimeoutDeadline(deadline: entry.deadline, id: id))
+
+# Arm the timer for the earliest deadline. If it is already armed for an
+# earlier one, leave it be; waking up early just re-arms it.
+proc arm(state: TimeoutState) =
+  if state.running:
+    return
+  state.compact()
+  if state.heap.len == 0:
+    state.disarm()
+    return
+  let deadline = state.heap[0].deadline
+  if state.timerFd != -1 and state.armed <= deadline:
+    return
+  state.disarm()
+  # round up, so that the timer never fires before the deadline
+  let ns = (deadline - getMonoTime()).inNanoseconds
+  let ms = max((ns + 999_999) div 1_000_000, 1)
+  state.timerFd = state.selector.registerTimer(int(ms), oneshot = true, 0)
+  state.armed = deadline
+
+proc freeEntry(state: TimeoutState; entry: TimeoutEntry) =
+  JS_FreeValue(state.jsctx, entry.val)
+  for arg in entry.args:
+    JS_FreeValue(state.jsctx, arg)
+
 proc clearTimeout*(state: var TimeoutState; id: int32) =
-  if id in state.timeouts:
-    let entry = state.timeouts[id]
-    state.selector.unregister(entry.fd)
-    JS_FreeValue(state.jsctx, entry.val)
-    for arg in entry.args:
-      JS_FreeValue(state.jsctx, arg)
-    state.timeoutFds.del(entry.fd)
-    state.timeouts.del(id)
+  var entry: TimeoutEntry
+  if state.timeouts.pop(id, entry):
+    state.freeEntry(entry)
+    if state.timeouts.len == 0:
+      state.arm()
 
 #TODO varargs
 proc setTimeout*(state: var TimeoutState; t: TimeoutType; handler: JSValue;
     timeout: int32; args: openArray[JSValue]): int32 =
   let id = state.timeoutid
   inc state.timeoutid
-  let fd = state.selector.registerTimer(max(timeout, 1), t == ttTimeout, 0)
-  state.timeoutFds[fd] = id
+  let interval = initDuration(milliseconds = max(timeout, 1))
   let entry = TimeoutEntry(
     t: t,
-    fd: fd,
+    interval: interval,
+    deadline: getMonoTime() + interval,
     val: JS_DupValue(state.jsctx, handler)
   )
   for arg in args:
     entry.args.add(JS_DupValue(state.jsctx, arg))
   state.timeouts[id] = entry
+  state.heap.push(TimeoutDeadline(deadline: entry.deadline, id: id))
+  state.arm()
   return id
 
 proc runEntry(state: var TimeoutState; entry: TimeoutEntry; name: string) =
@@ -78,22 +143,48 @@ proc runEntry(state: var TimeoutState; entry: TimeoutEntry; name: string) =
     var s: string
     if state.jsctx.fromJS(entry.val, s).isSome:
       state.evalJSFree(s, name)
+  # Microtask checkpoint: promise reactions queued by a handler must run
+  # before the next timer's handler.
+  let rt = JS_GetRuntime(state.jsctx)
+  while true:
+    let r = rt.runJSJobs()
+    if r.isSome:
+      break
+    r.error.writeException(state.err)
 
+# Run every timer that is due, then re-arm the timer fd for the next one.
+# Timers set by the handlers are never due yet, so this always terminates.
 proc runTimeoutFd*(state: var TimeoutState; fd: int): bool =
-  if fd notin state.timeoutFds:
+  if fd != state.timerFd:
     return false
-  let id = state.timeoutFds[fd]
-  let entry = state.timeouts[id]
-  state.runEntry(entry, $entry.t)
-  if entry.t == ttTimeout:
-    state.clearTimeout(id)
+  state.disarm()
+  state.running = true
+  let now = getMonoTime()
+  while state.heap.len > 0 and state.heap[0].deadline <= now:
+    let it = state.heap.pop()
+    let entry = state.timeouts.getOrDefault(it.id)
+    if entry == nil or entry.deadline != it.deadline:
+      continue # cleared
+    if entry.t == ttInterval:
+      # Schedule from the previous deadline, so that the interval does not
+      # drift by the time it takes to wake up. If we have fallen behind by
+      # more than an interval, skip the missed runs instead of bursting.
+      entry.deadline = it.deadline + entry.interval
+      if entry.deadline <= now:
+        entry.deadline = now + entry.interval
+      state.heap.push(TimeoutDeadline(deadline: entry.deadline, id: it.id))
+      state.runEntry(entry, $entry.t)
+    else:
+      state.timeouts.del(it.id)
+      state.runEntry(entry, $entry.t)
+      state.freeEntry(entry)
+  state.running = false
+  state.arm()
   return true
 
 proc clearAll*(state: var TimeoutState) =
   for entry in state.timeouts.values:
-    state.selector.unregister(entry.fd)
-    JS_FreeValue(state.jsctx, entry.val)
-    for arg in entry.args:
-      JS_FreeValue(state.jsctx, arg)
+    state.freeEntry(entry)
   state.timeouts.clear()
-  state.timeoutFds.clear()
+  state.heap.clear()
+  state.disarm()
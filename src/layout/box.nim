@@ -16,7 +16,9 @@ type
   InlineAtomType* = enum
     iatWord, iatInlineBlock, iatImage
 
-  InlineAtom* = ref object
+  # Inline atoms are allocated in the atoms arena of their root fragment,
+  # and referred to by index everywhere else.
+  InlineAtom* = object
     offset*: Offset
     size*: Size
     case t*: InlineAtomType
@@ -44,6 +46,8 @@ type
   RootInlineFragment* = ref object
     fragment*: InlineFragment # root fragment
     state*: RootInlineFragmentState
+    # all atoms of the last layout; truncated (but not freed) on relayout
+    atoms*: seq[InlineAtom]
 
   SplitType* = enum
     stSplitStart, stSplitEnd
@@ -55,7 +59,7 @@ type
   InlineFragmentState* = object
     startOffset*: Offset # offset of the first word, for position: absolute
     areas*: seq[Area] # background that should be painted by fragment
-    atoms*: seq[InlineAtom]
+    atoms*: seq[int] # indices into RootInlineFragment.atoms
 
   InlineFragmentType* = enum
     iftParent, iftText, iftNewline, iftBitmap, iftBox
@@ -83,6 +87,29 @@ type
 
   RelativeRect* = array[DimensionType, Span]
 
+  # min-content: box width is longest word's width
+  # max-content: box width is content width without wrapping
+  # stretch: box width is n px wide
+  # fit-content: also known as shrink-to-fit, box width is
+  #   min(max-content, stretch(availableWidth))
+  #   in other words, as wide as needed, but wrap if wider than allowed
+  # (note: I write width here, but it can apply for any constraint)
+  SizeConstraintType* = enum
+    scStretch, scFitContent, scMinContent, scMaxContent
+
+  SizeConstraint* = object
+    t*: SizeConstraintType
+    u*: LayoutUnit
+
+  AvailableSpace* = array[DimensionType, SizeConstraint]
+
+  ResolvedSizes* = object
+    margin*: RelativeRect
+    padding*: RelativeRect
+    positioned*: RelativeRect
+    space*: AvailableSpace
+    minMaxSizes*: array[DimensionType, Span]
+
   BlockBoxLayoutState* = object
     # offset relative to parent
     offset*: Offset
@@ -99,8 +126,18 @@ type
     # baseline of the last line box of all descendants
     baseline*: LayoutUnit
 
+  # Layout state of a box that establishes an independent formatting context,
+  # saved right after it was laid out with the given sizes (and containing
+  # block for absolute positioning.)
+  LayoutMemo* = object
+    valid*: bool
+    sizes*: ResolvedSizes
+    positioned*: AvailableSpace
+    state*: BlockBoxLayoutState
+
   BlockBox* = ref object
     state*: BlockBoxLayoutState
+    memo*: LayoutMemo
     computed*: CSSComputedValues
     node*: StyledNode
     inline*: RootInlineFragment
@@ -23,29 +23,6 @@ type
     audioText: StyledNode
     videoText: StyledNode
 
-  # min-content: box width is longest word's width
-  # max-content: box width is content width without wrapping
-  # stretch: box width is n px wide
-  # fit-content: also known as shrink-to-fit, box width is
-  #   min(max-content, stretch(availableWidth))
-  #   in other words, as wide as needed, but wrap if wider than allowed
-  # (note: I write width here, but it can apply for any constraint)
-  SizeConstraintType = enum
-    scStretch, scFitContent, scMinContent, scMaxContent
-
-  SizeConstraint = object
-    t: SizeConstraintType
-    u: LayoutUnit
-
-  AvailableSpace = array[DimensionType, SizeConstraint]
-
-  ResolvedSizes = object
-    margin: RelativeRect
-    padding: RelativeRect
-    positioned: RelativeRect
-    space: AvailableSpace
-    minMaxSizes: array[DimensionType, Span]
-
 const DefaultSpan = Span(start: 0, send: LayoutUnit.high)
 
 func minWidth(sizes: ResolvedSizes): LayoutUnit =
@@ -204,6 +181,15 @@ type
     offset: Offset
     size: Size
     t: CSSFloat
+    # The following fields describe this exclusion together with all the
+    # ones added before it, so that they stay valid when the list is
+    # truncated for a re-layout.
+    # Lowest bottom edge of left/right floats, or low(LayoutUnit) if none.
+    leftBottom: LayoutUnit
+    rightBottom: LayoutUnit
+    # True if the top edges of the exclusions up to this one are in
+    # ascending order.
+    sorted: bool
 
   Strut = object
     pos: LayoutUnit
@@ -224,7 +210,7 @@ type
     # minimum height to fit all inline atoms
     minHeight: LayoutUnit
     paddingTodo: seq[tuple[fragment: InlineFragment; i: int]]
-    atoms: seq[InlineAtom]
+    atoms: seq[int] # indices into root.atoms
     size: Size
     availableWidth: LayoutUnit # actual place available after float exclusions
     offsety: LayoutUnit # offset of line in root fragment
@@ -305,7 +291,7 @@ func computeShift(ictx: InlineContext; state: InlineState): LayoutUnit =
   if not state.fragment.computed.whitespacepre:
     if ictx.lbstate.atoms.len == 0:
       return 0
-    let atom = ictx.lbstate.atoms[^1]
+    template atom: untyped = ictx.root.atoms[ictx.lbstate.atoms[^1]]
     if atom.t == iatWord and atom.str[^1] == ' ':
       return 0
   return ictx.cellWidth * ictx.whitespacenum
@@ -356,10 +342,12 @@ const TextAlignNone = {
 # Resize the line's height based on atoms' height and baseline.
 # The line height should be at least as high as the highest baseline used by
 # an atom plus that atom's height.
-func resizeLine(lbstate: LineBoxState; lctx: LayoutContext): LayoutUnit =
+func resizeLine(lbstate: LineBoxState; root: RootInlineFragment;
+    lctx: LayoutContext): LayoutUnit =
   let baseline = lbstate.baseline
   var h = lbstate.size.h
-  for i, atom in lbstate.atoms:
+  for i, ai in lbstate.atoms:
+    template atom: untyped = root.atoms[ai]
     let iastate = lbstate.atomStates[i]
     # In all cases, the line's height must at least equal the atom's height.
     # (Where the atom is actually placed is irrelevant here.)
@@ -382,10 +370,12 @@ func resizeLine(lbstate: LineBoxState; lctx: LayoutContext): LayoutUnit =
   return h
 
 # returns marginTop
-proc positionAtoms(lbstate: LineBoxState; lctx: LayoutContext): LayoutUnit =
+proc positionAtoms(lbstate: LineBoxState; root: RootInlineFragment;
+    lctx: LayoutContext): LayoutUnit =
   let baseline = lbstate.baseline
   var marginTop: LayoutUnit = 0
-  for i, atom in lbstate.atoms:
+  for i, ai in lbstate.atoms:
+    template atom: untyped = root.atoms[ai]
     let iastate = lbstate.atomStates[i]
     case iastate.vertalign.keyword
     of VerticalAlignBaseline:
@@ -435,7 +425,8 @@ proc shiftAtoms(ictx: var InlineContext; marginTop: LayoutUnit) =
   var currentFragment: InlineFragment = nil
   let offsetyShifted = shiftTop + offsety
   let areaY = offsetyShifted + ictx.lbstate.baseline - cellHeight
-  for i, atom in ictx.lbstate.atoms:
+  for i, ai in ictx.lbstate.atoms:
+    template atom: untyped = root.atoms[ai]
     atom.offset.y = (atom.offset.y + offsetyShifted).round(cellHeight)
     #TODO why not offsetyShifted here?
     let minHeight = atom.offset.y - offsety + atom.size.h
@@ -458,12 +449,12 @@ proc shiftAtoms(ictx: var InlineContext; marginTop: LayoutUnit) =
       currentFragment = fragment
       # init new fragment
       currentAreaOffsetX = if fragment.state.areas.len == 0:
-        fragment.state.atoms[0].offset.x
+        root.atoms[fragment.state.atoms[0]].offset.x
       else:
-        ictx.lbstate.atoms[0].offset.x
+        root.atoms[ictx.lbstate.atoms[0]].offset.x
   if currentFragment != nil:
     # flush area
-    let atom = ictx.lbstate.atoms[^1]
+    template atom: untyped = root.atoms[ictx.lbstate.atoms[^1]]
     # it seems cellHeight is what other browsers use here too?
     let w = atom.offset.x + atom.size.w - currentAreaOffsetX
     let offset = offset(x = currentAreaOffsetX, y = areaY)
@@ -494,9 +485,9 @@ proc alignLine(ictx: var InlineContext) =
   ictx.lbstate.baseline = max(ictx.lbstate.baseline, lineHeight)
     .round(ch)
   # Resize according to the baseline and atom sizes.
-  ictx.lbstate.size.h = ictx.lbstate.resizeLine(ictx.lctx)
+  ictx.lbstate.size.h = ictx.lbstate.resizeLine(ictx.root, ictx.lctx)
   # Now we can calculate the actual position of atoms inside the line.
-  let marginTop = ictx.lbstate.positionAtoms(ictx.lctx)
+  let marginTop = ictx.lbstate.positionAtoms(ictx.root, ictx.lctx)
   #TODO this does not really work with rounding :/
   ictx.lbstate.baseline += ictx.lbstate.paddingTop
   # Finally, offset all atoms' y position by the largest top margin and the
@@ -516,27 +507,29 @@ proc alignLine(ictx: var InlineContext) =
   # Set the line height to size.h.
   ictx.lbstate.height = ictx.lbstate.size.h
 
-proc putAtom(state: var LineBoxState; atom: InlineAtom;
+proc putAtom(ictx: var InlineContext; atom: sink InlineAtom;
     iastate: InlineAtomState; fragment: InlineFragment) =
-  state.atomStates.add(iastate)
-  state.atomStates[^1].fragment = fragment
-  state.atoms.add(atom)
-  fragment.state.atoms.add(atom)
+  let i = ictx.root.atoms.len
+  ictx.root.atoms.add(atom)
+  ictx.lbstate.atomStates.add(iastate)
+  ictx.lbstate.atomStates[^1].fragment = fragment
+  ictx.lbstate.atoms.add(i)
+  fragment.state.atoms.add(i)
 
 proc addSpacing(ictx: var InlineContext; width: LayoutUnit; state: InlineState;
     hang = false) =
   let fragment = ictx.whitespaceFragment
   if fragment.state.atoms.len == 0 or ictx.lbstate.atoms.len == 0 or
-      (let oatom = fragment.state.atoms[^1];
-        oatom.t != iatWord or oatom != ictx.lbstate.atoms[^1]):
+      (let oi = fragment.state.atoms[^1];
+        ictx.root.atoms[oi].t != iatWord or oi != ictx.lbstate.atoms[^1]):
     let atom = InlineAtom(
       t: iatWord,
       size: size(w = 0, h = ictx.cellHeight),
       offset: offset(x = ictx.lbstate.size.w, y = ictx.cellHeight)
     )
-    let iastate = InlineAtomState(baseline: atom.size.h)
-    ictx.lbstate.putAtom(atom, iastate, fragment)
-  let atom = fragment.state.atoms[^1]
+    let iastate = InlineAtomState(baseline: ictx.cellHeight)
+    ictx.putAtom(atom, iastate, fragment)
+  template atom: untyped = ictx.root.atoms[fragment.state.atoms[^1]]
   let n = (width div ictx.cellWidth).toInt #TODO
   for i in 0 ..< n:
     atom.str &= ' '
@@ -554,6 +547,51 @@ proc flushWhitespace(ictx: var InlineContext; state: InlineState;
   if shift > 0:
     ictx.addSpacing(shift, state, hang)
 
+func maxBottom(ex: Exclusion): LayoutUnit =
+  return max(ex.leftBottom, ex.rightBottom)
+
+proc addExclusion(bctx: var BlockContext; ex: Exclusion) =
+  var ex = ex
+  ex.leftBottom = low(LayoutUnit)
+  ex.rightBottom = low(LayoutUnit)
+  ex.sorted = true
+  if bctx.exclusions.len > 0:
+    let prev = bctx.exclusions[^1]
+    ex.leftBottom = prev.leftBottom
+    ex.rightBottom = prev.rightBottom
+    ex.sorted = prev.sorted and prev.offset.y <= ex.offset.y
+  let bottom = ex.offset.y + ex.size.h
+  if ex.t == FloatLeft:
+    ex.leftBottom = max(ex.leftBottom, bottom)
+  else:
+    ex.rightBottom = max(ex.rightBottom, bottom)
+  bctx.exclusions.add(ex)
+
+# Range of exclusions that may intersect with the vertical span [y1, y2].
+# Exclusions before the range all end above y1 (maxBottom grows
+# monotonically), so they are skipped with a binary search; if the exclusions
+# were added in ascending y order, the ones after the range all start below
+# y2, so they are skipped too.
+func exclusionRange(bctx: BlockContext; y1, y2: LayoutUnit): Slice[int] =
+  var lo = 0
+  var hi = bctx.exclusions.len
+  while lo < hi:
+    let mid = (lo + hi) div 2
+    if bctx.exclusions[mid].maxBottom <= y1:
+      lo = mid + 1
+    else:
+      hi = mid
+  let start = lo
+  hi = bctx.exclusions.len
+  if hi > 0 and bctx.exclusions[^1].sorted:
+    while lo < hi:
+      let mid = (lo + hi) div 2
+      if bctx.exclusions[mid].offset.y <= y2:
+        lo = mid + 1
+      else:
+        hi = mid
+  return start ..< hi
+
 # Prepare the next line's initial width and available width.
 # (If space on the left is excluded by floats, set the initial width to
 # the end of that space. If space on the right is excluded, set the available
@@ -567,7 +605,8 @@ proc initLine(ictx: var InlineContext) =
     let y = ictx.lbstate.offsety + bfcOffset.y
     var left = bfcOffset.x
     var right = bfcOffset.x + ictx.lbstate.availableWidth
-    for ex in bctx.exclusions:
+    for i in bctx.exclusionRange(y, y):
+      let ex = bctx.exclusions[i]
       if ex.offset.y <= y and y < ex.offset.y + ex.size.h:
         ictx.lbstate.hasExclusion = true
         if ex.t == FloatLeft:
@@ -613,6 +652,37 @@ proc finishLine(ictx: var InlineContext; state: var InlineState; wrap: bool;
     ictx.lbstate = LineBoxState(offsety: y + ictx.lbstate.size.h)
     ictx.initLine()
 
+# Skip the lines following the line at offsety that has just been flushed
+# with height h, as long as they intersect the same exclusions. They have the
+# same available width, so an atom that did not fit on that line would not
+# fit on them either.
+proc skipExcludedLines(ictx: var InlineContext; offsety, h: LayoutUnit) =
+  let bctx = ictx.bctx
+  let y = offsety + ictx.bfcOffset.y
+  # The exclusions that intersect a line only change at the next top or
+  # bottom edge below y.
+  var next = high(LayoutUnit)
+  let slice = bctx.exclusionRange(y, y)
+  for i in slice:
+    let ex = bctx.exclusions[i]
+    let ey2 = ex.offset.y + ex.size.h
+    if ex.offset.y > y:
+      next = min(next, ex.offset.y)
+    elif ey2 > y:
+      next = min(next, ey2)
+  if slice.b + 1 < bctx.exclusions.len:
+    next = min(next, bctx.exclusions[slice.b + 1].offset.y)
+  if next == high(LayoutUnit) or h <= 0:
+    return
+  # number of lines after the flushed one that start above next
+  let n = (int32(next - y) - 1) div int32(h)
+  if n > 0:
+    let skipped = LayoutUnit(int32(h) * n)
+    ictx.size.h += skipped
+    ictx.root.state.baseline += skipped
+    ictx.lbstate = LineBoxState(offsety: ictx.lbstate.offsety + skipped)
+    ictx.initLine()
+
 func xminwidth(atom: InlineAtom): LayoutUnit =
   if atom.t == iatInlineBlock:
     return atom.innerbox.state.xminwidth
@@ -644,8 +714,9 @@ proc flushLine(ictx: var InlineContext; state: var InlineState) =
 # Add an inline atom atom, with state iastate.
 # Returns true on newline.
 proc addAtom(ictx: var InlineContext; state: var InlineState;
-    iastate: InlineAtomState; atom: InlineAtom): bool =
+    iastate: InlineAtomState; atom: sink InlineAtom): bool =
   result = false
+  var atom = atom
   var shift = ictx.computeShift(state)
   ictx.lbstate.charwidth += ictx.whitespacenum
   ictx.whitespacenum = 0
@@ -656,12 +727,13 @@ proc addAtom(ictx: var InlineContext; state: var InlineState;
     # Recompute on newline
     shift = ictx.computeShift(state)
     # For floats: flush lines until we can place the atom.
-    #TODO this is inefficient
     while ictx.shouldWrap2(atom.size.w + shift):
+      let offsety = ictx.lbstate.offsety
       ictx.applyLineHeight(ictx.lbstate, state.fragment.computed)
       ictx.lbstate.lineHeight = max(ictx.lbstate.lineHeight,
         ictx.cellHeight)
       ictx.finishLine(state, wrap = false, force = true)
+      ictx.skipExcludedLines(offsety, ictx.lbstate.offsety - offsety)
       # Recompute on newline
       shift = ictx.computeShift(state)
   if atom.size.w > 0 and atom.size.h > 0:
@@ -671,15 +743,15 @@ proc addAtom(ictx: var InlineContext; state: var InlineState;
     ictx.applyLineHeight(ictx.lbstate, state.fragment.computed)
     if atom.t == iatWord:
       if ictx.lbstate.atoms.len > 0 and state.fragment.state.atoms.len > 0:
-        let oatom = ictx.lbstate.atoms[^1]
-        if oatom.t == iatWord and oatom == state.fragment.state.atoms[^1]:
+        let oi = ictx.lbstate.atoms[^1]
+        template oatom: untyped = ictx.root.atoms[oi]
+        if oatom.t == iatWord and oi == state.fragment.state.atoms[^1]:
           oatom.str &= atom.str
           oatom.size.w += atom.size.w
           ictx.lbstate.size.w += atom.size.w
           return
     else:
       ictx.lbstate.charwidth = 0
-    ictx.lbstate.putAtom(atom, iastate, state.fragment)
     atom.offset.x += ictx.lbstate.size.w
     ictx.lbstate.size.w += atom.size.w
     let baseline = case iastate.vertalign.keyword
@@ -695,16 +767,16 @@ proc addAtom(ictx: var InlineContext; state: var InlineState;
     # store for later use in resizeLine/shiftAtoms
     atom.offset.y = baseline
     ictx.lbstate.baseline = max(ictx.lbstate.baseline, baseline)
+    ictx.putAtom(atom, iastate, state.fragment)
 
 proc addWord(ictx: var InlineContext; state: var InlineState): bool =
   result = false
   if ictx.word.str != "":
-    ictx.word.str.mnormalize() #TODO this may break on EOL.
     let iastate = InlineAtomState(
       vertalign: state.fragment.computed{"vertical-align"},
       baseline: ictx.word.size.h
     )
-    result = ictx.addAtom(state, iastate, ictx.word)
+    result = ictx.addAtom(state, iastate, move(ictx.word))
     ictx.newWord()
 
 proc addWordEOL(ictx: var InlineContext; state: var InlineState): bool =
@@ -806,8 +878,9 @@ func initInlineContext(bctx: var BlockContext; space: AvailableSpace;
   return ictx
 
 proc layoutTextLoop(ictx: var InlineContext; state: var InlineState;
-    str: string) =
+    str: openArray[char]; widths: openArray[uint8]) =
   var i = 0
+  var k = 0 # index of the next non-ASCII code point's width
   while i < str.len:
     let c = str[i]
     if c in Ascii:
@@ -826,7 +899,8 @@ proc layoutTextLoop(ictx: var InlineContext; state: var InlineState;
     else:
       let pi = i
       let u = str.nextUTF8(i)
-      let w = u.width()
+      let w = int(widths[k])
+      inc k
       ictx.checkWrap(state, u, w)
       if u == 0xAD: # soft hyphen
         ictx.wrappos = ictx.word.str.len
@@ -840,22 +914,51 @@ proc layoutTextLoop(ictx: var InlineContext; state: var InlineState;
   let shift = ictx.computeShift(state)
   ictx.lbstate.widthAfterWhitespace = ictx.lbstate.size.w + shift
 
-proc layoutText(ictx: var InlineContext; state: var InlineState; s: string) =
+proc updateShape(shape: var TextShape; data: string; generation: uint32;
+    transform: CSSTextTransform) =
+  if shape.built and shape.generation == generation and
+      shape.transform == transform:
+    return
+  shape.built = true
+  shape.generation = generation
+  shape.transform = transform
+  shape.widths.setLen(0)
+  if transform == TextTransformNone and NonAscii notin data:
+    # nothing to transform, normalize or measure
+    shape.copy = false
+    shape.s = ""
+    return
+  shape.s = case transform
+  of TextTransformNone: data
+  of TextTransformCapitalize: data.capitalizeLU()
+  of TextTransformUppercase: data.toUpperLU()
+  of TextTransformLowercase: data.toLowerLU()
+  of TextTransformFullWidth: data.fullwidth()
+  of TextTransformFullSizeKana: data.fullsize()
+  of TextTransformChaHalfWidth: data.halfwidth()
+  # ASCII whitespace never composes with anything, so normalizing the whole
+  # text is the same as normalizing each word.
+  shape.s.mnormalize()
+  shape.copy = shape.s != data
+  var i = 0
+  while i < shape.s.len:
+    if shape.s[i] in Ascii:
+      inc i
+    else:
+      shape.widths.add(uint8(shape.s.nextUTF8(i).width()))
+  if not shape.copy:
+    shape.s = ""
+
+proc layoutText(ictx: var InlineContext; state: var InlineState;
+    text: StyledNode) =
   ictx.flushWhitespace(state)
   ictx.newWord()
-  let transform = state.fragment.computed{"text-transform"}
-  if transform == TextTransformNone:
-    ictx.layoutTextLoop(state, s)
+  text.shape.updateShape(text.textData, text.textGeneration,
+    state.fragment.computed{"text-transform"})
+  if text.shape.copy:
+    ictx.layoutTextLoop(state, text.shape.s, text.shape.widths)
   else:
-    let s = case transform
-    of TextTransformCapitalize: s.capitalizeLU()
-    of TextTransformUppercase: s.toUpperLU()
-    of TextTransformLowercase: s.toLowerLU()
-    of TextTransformFullWidth: s.fullwidth()
-    of TextTransformFullSizeKana: s.fullsize()
-    of TextTransformChaHalfWidth: s.halfwidth()
-    else: ""
-    ictx.layoutTextLoop(state, s)
+    ictx.layoutTextLoop(state, text.textData, text.shape.widths)
 
 func spx(l: CSSLength; lctx: LayoutContext; p: SizeConstraint;
     computed: CSSComputedValues; padding: LayoutUnit): LayoutUnit =
@@ -1241,19 +1344,14 @@ proc flushMargins(bctx: var BlockContext; box: BlockBox) =
 
 proc clearFloats(offset: var Offset; bctx: var BlockContext; clear: CSSClear) =
   var y = bctx.bfcOffset.y + offset.y
-  case clear
-  of ClearLeft, ClearInlineStart:
-    for ex in bctx.exclusions:
-      if ex.t == FloatLeft:
-        y = max(ex.offset.y + ex.size.h, y)
-  of ClearRight, ClearInlineEnd:
-    for ex in bctx.exclusions:
-      if ex.t == FloatRight:
-        y = max(ex.offset.y + ex.size.h, y)
-  of ClearBoth:
-    for ex in bctx.exclusions:
-      y = max(ex.offset.y + ex.size.h, y)
-  of ClearNone: assert false
+  assert clear != ClearNone
+  if bctx.exclusions.len > 0:
+    let ex = bctx.exclusions[^1]
+    case clear
+    of ClearLeft, ClearInlineStart: y = max(ex.leftBottom, y)
+    of ClearRight, ClearInlineEnd: y = max(ex.rightBottom, y)
+    of ClearBoth: y = max(ex.maxBottom, y)
+    of ClearNone: discard
   bctx.clearOffset = y
   offset.y = y - bctx.bfcOffset.y
 
@@ -1283,15 +1381,25 @@ func findNextFloatOffset(bctx: BlockContext; offset: Offset; size: Size;
     var left = leftStart
     var right = rightStart
     var miny = high(LayoutUnit)
+    # Bottom edge of the lowest exclusion that leaves less than size.w on its
+    # own; there is no room above it.
+    var blocky = low(LayoutUnit)
     let cy2 = y + size.h
-    for ex in bctx.exclusions:
+    for i in bctx.exclusionRange(y, cy2):
+      let ex = bctx.exclusions[i]
       let ey2 = ex.offset.y + ex.size.h
       if cy2 >= ex.offset.y and y < ey2:
         let ex2 = ex.offset.x + ex.size.w
-        if ex.t == FloatLeft and left < ex2:
-          left = ex2
-        if ex.t == FloatRight and right > ex.offset.x:
-          right = ex.offset.x
+        if ex.t == FloatLeft:
+          if left < ex2:
+            left = ex2
+          if rightStart - ex2 < size.w:
+            blocky = max(blocky, ey2)
+        else:
+          if right > ex.offset.x:
+            right = ex.offset.x
+          if ex.offset.x - leftStart < size.w:
+            blocky = max(blocky, ey2)
         miny = min(ey2, miny)
     let w = right - left
     if w >= size.w or miny == high(LayoutUnit):
@@ -1302,8 +1410,9 @@ func findNextFloatOffset(bctx: BlockContext; offset: Offset; size: Size;
       else: # FloatRight
         return offset(x = right - size.w, y = y)
     # Move y to the bottom exclusion edge at the lowest y (where the exclusion
-    # still intersects with the previous y).
-    y = miny
+    # still intersects with the previous y), or past all the exclusions that
+    # leave no room by themselves.
+    y = max(miny, blocky)
   assert false
 
 func findNextFloatOffset(bctx: BlockContext; offset: Offset; size: Size;
@@ -1337,9 +1446,8 @@ proc positionFloat(bctx: var BlockContext; child: BlockBox;
     x = offset.x - bfcOffset.x + child.state.margin.left,
     y = offset.y - bfcOffset.y + child.state.margin.top
   )
-  let ex = Exclusion(offset: offset, size: size, t: ft)
-  bctx.exclusions.add(ex)
-  bctx.maxFloatHeight = max(bctx.maxFloatHeight, ex.offset.y + ex.size.h)
+  bctx.addExclusion(Exclusion(offset: offset, size: size, t: ft))
+  bctx.maxFloatHeight = max(bctx.maxFloatHeight, offset.y + size.h)
 
 proc applyOverflowDimensions(box, child: BlockBox) =
   var childOverflow = child.state.overflow
@@ -1440,7 +1548,7 @@ proc addInlineBlock(ictx: var InlineContext; state: var InlineState;
 
 proc addInlineImage(ictx: var InlineContext; state: var InlineState;
     bmp: NetworkBitmap; padding: LayoutUnit) =
-  let atom = InlineAtom(
+  var atom = InlineAtom(
     t: iatImage,
     bmp: bmp,
     size: size(w = int(bmp.width), h = int(bmp.height)) #TODO overflow
@@ -1543,7 +1651,7 @@ proc layoutInline(ictx: var InlineContext; fragment: InlineFragment) =
   of iftNewline: ictx.flushLine(state)
   of iftBox: ictx.addInlineBlock(state, fragment.box)
   of iftBitmap: ictx.addInlineImage(state, fragment.bmp, padding.sum())
-  of iftText: ictx.layoutText(state, fragment.text.textData)
+  of iftText: ictx.layoutText(state, fragment.text)
   of iftParent:
     for child in fragment.children:
       ictx.layoutInline(child)
@@ -1573,6 +1681,7 @@ proc layoutRootInline0(bctx: var BlockContext; ictx: var InlineContext;
     root: RootInlineFragment; space: AvailableSpace;
     computed: CSSComputedValues; offset, bfcOffset: Offset) =
   root.state = RootInlineFragmentState(offset: offset)
+  root.atoms.setLen(0)
   ictx.layoutInline(root.fragment)
   if ictx.lastTextFragment != nil:
     let fragment = ictx.lastTextFragment
@@ -1676,6 +1785,28 @@ type
     inlineSpacing: LayoutUnit
     space: AvailableSpace # space we got from parent
 
+# Table cells and flex items are laid out in their own BFC, but usually
+# several times, and often with the same sizes as in the previous pass.
+# Their layout only depends on the sizes, and on the containing block of
+# absolutely positioned descendants; if those did not change since the last
+# layout, then the subtree still holds its result, and we only have to
+# restore the box's own state (which the parent may have modified since.)
+proc restoreMemo(lctx: LayoutContext; box: BlockBox; sizes: ResolvedSizes):
+    bool =
+  if box.memo.valid and box.memo.sizes == sizes and
+      box.memo.positioned == lctx.positioned[^1]:
+    box.state = box.memo.state
+    return true
+  return false
+
+proc saveMemo(lctx: LayoutContext; box: BlockBox; sizes: ResolvedSizes) =
+  box.memo = LayoutMemo(
+    valid: true,
+    sizes: sizes,
+    positioned: lctx.positioned[^1],
+    state: box.state
+  )
+
 proc layoutTableCell(lctx: LayoutContext; box: BlockBox;
     space: AvailableSpace) =
   var sizes = ResolvedSizes(
@@ -1689,6 +1820,8 @@ proc layoutTableCell(lctx: LayoutContext; box: BlockBox;
   if sizes.space.h.isDefinite():
     sizes.space.h.u -= sizes.padding.top
     sizes.space.h.u -= sizes.padding.bottom
+  if lctx.restoreMemo(box, sizes):
+    return
   box.state = BlockBoxLayoutState(positioned: sizes.positioned)
   var bctx = BlockContext(lctx: lctx)
   bctx.layoutFlow(box, sizes)
@@ -1698,6 +1831,7 @@ proc layoutTableCell(lctx: LayoutContext; box: BlockBox;
   # If the highest float edge is higher than the box itself, set that as
   # the box height.
   box.state.size.h = max(box.state.size.h, bctx.maxFloatHeight)
+  lctx.saveMemo(box, sizes)
 
 # Sort growing cells, and filter out cells that have grown to their intended
 # rowspan.
@@ -2133,6 +2267,8 @@ proc layout(bctx: var BlockContext; box: BlockBox; sizes: ResolvedSizes) =
     assert false
 
 proc layoutFlexChild(lctx: LayoutContext; box: BlockBox; sizes: ResolvedSizes) =
+  if lctx.restoreMemo(box, sizes):
+    return
   var bctx = BlockContext(lctx: lctx)
   # note: we do not append margins here, since those belong to the flex item,
   # not its inner BFC.
@@ -2146,6 +2282,7 @@ proc layoutFlexChild(lctx: LayoutContext; box: BlockBox; sizes: ResolvedSizes) =
   # If the highest float edge is higher than the box itself, set that as
   # the box height.
   box.state.size.h = max(box.state.size.h, bctx.maxFloatHeight)
+  lctx.saveMemo(box, sizes)
 
 type
   FlexWeightType = enum
@@ -1,4 +1,4 @@
-import std/strutils
+import std/tables
 
 import css/cssvalues
 import css/stylednode
@@ -38,20 +38,6 @@ func findFormatN*(line: FlexibleLine; pos: int): int =
     inc i
   return i
 
-proc addLines(grid: var FlexibleGrid; n: int) =
-  grid.setLen(grid.len + n)
-
-proc insertFormat(line: var FlexibleLine; i: int; cell: FormatCell) =
-  line.formats.insert(cell, i)
-
-proc insertFormat(line: var FlexibleLine; pos, i: int; format: Format;
-    node: StyledNode = nil) =
-  line.insertFormat(i, FormatCell(format: format, node: node, pos: pos))
-
-proc addFormat(line: var FlexibleLine; pos: int; format: Format;
-    node: StyledNode = nil) =
-  line.formats.add(FormatCell(format: format, node: node, pos: pos))
-
 func toFormat(computed: CSSComputedValues): Format =
   if computed == nil:
     return Format()
@@ -73,141 +59,48 @@ func toFormat(computed: CSSComputedValues): Format =
     flags: flags
   )
 
-proc findFirstX(line: var FlexibleLine; x: int; outi: var int): int =
-  var cx = 0
-  var i = 0
-  while cx < x and i < line.str.len:
-    let pi = i
-    let u = line.str.nextUTF8(i)
-    let w = u.twidth(cx)
-    # we must ensure x is max(cx, x), otherwise our assumption of cx <= x
-    # breaks down
-    if cx + w > x:
-      i = pi
-      break
-    cx += w
-  outi = i
-  return cx
-
-proc setTextStr(line: var FlexibleLine; linestr, ostr: string;
-    i, x, cx, nx, targetX: int) =
-  var i = i
-  let padlen = i + x - cx
-  var widthError = max(nx - targetX, 0)
-  let linestrTargetI = padlen + linestr.len
-  line.str.setLen(linestrTargetI + widthError + ostr.len)
-  while i < padlen: # place before new string
-    line.str[i] = ' '
-    inc i
-  copyMem(addr line.str[i], unsafeAddr linestr[0], linestr.len)
-  i = linestrTargetI
-  while widthError > 0:
-    # we ate half of a double width char; pad it out with spaces.
-    line.str[i] = ' '
-    dec widthError
-    inc i
-  if ostr.len > 0:
-    copyMem(addr line.str[i], unsafeAddr ostr[0], ostr.len)
-
-proc setTextFormat(line: var FlexibleLine; x, cx, nx: int; ostr: string;
-    format: Format; node: StyledNode) =
-  var fi = line.findFormatN(cx) - 1 # Skip unchanged formats before new string
-  if x > cx:
-    # Replace formats for padding
-    var padformat = Format()
-    if fi == -1:
-      # No formats
-      inc fi # insert after first format (meaning fi = 0)
-      line.insertFormat(cx, fi, padformat)
-    else:
-      # First format's pos may be == cx here.
-      if line.formats[fi].pos == cx:
-        padformat.bgcolor = line.formats[fi].format.bgcolor
-        let node = line.formats[fi].node
-        line.formats.delete(fi)
-        line.insertFormat(cx, fi, padformat, node)
-      else:
-        # First format < cx => split it up
-        assert line.formats[fi].pos < cx
-        padformat.bgcolor = line.formats[fi].format.bgcolor
-        let node = line.formats[fi].node
-        inc fi # insert after first format
-        line.insertFormat(cx, fi, padformat, node)
-    inc fi # skip last format
-    while fi < line.formats.len and line.formats[fi].pos < x:
-      # Other formats must be > cx => replace them
-      padformat.bgcolor = line.formats[fi].format.bgcolor
-      let node = line.formats[fi].node
-      let px = line.formats[fi].pos
-      line.formats.delete(fi)
-      line.insertFormat(px, fi, padformat, node)
-      inc fi
-    dec fi # go back to previous format, so that pos <= x
-    assert line.formats[fi].pos <= x
-  # Now for the text's formats:
-  var format = format
-  var lformat: Format
-  var lnode: StyledNode
-  if fi == -1:
-    # No formats => just insert a new format at 0
-    inc fi
-    line.insertFormat(x, fi, format, node)
-    lformat = Format()
-  else:
-    # First format's pos may be == x here.
-    lformat = line.formats[fi].format # save for later use
-    lnode = line.formats[fi].node
-    if line.formats[fi].pos == x:
-      # Replace.
-      # We must check if the old string's last x position is greater than
-      # the new string's first x position. If not, we cannot inherit
-      # its bgcolor (which is supposed to end before the new string started.)
-      if nx > cx:
-        format.bgcolor = line.formats[fi].format.bgcolor
-      line.formats.delete(fi)
-      line.insertFormat(x, fi, format, node)
-    else:
-      # First format's pos < x => split it up.
-      assert line.formats[fi].pos < x
-      if nx > cx: # see above
-        format.bgcolor = line.formats[fi].format.bgcolor
-      inc fi # insert after first format
-      line.insertFormat(x, fi, format, node)
-  inc fi # skip last format
-  while fi < line.formats.len and line.formats[fi].pos < nx:
-    # Other formats must be > x => replace them
-    format.bgcolor = line.formats[fi].format.bgcolor
-    let px = line.formats[fi].pos
-    lformat = line.formats[fi].format # save for later use
-    lnode = line.formats[fi].node
-    line.formats.delete(fi)
-    line.insertFormat(px, fi, format, node)
-    inc fi
-  if ostr.len > 0 and (fi >= line.formats.len or line.formats[fi].pos > nx):
-    # nx < ostr.width, but we have removed all formatting in the range of our
-    # string, and no formatting comes directly after it. So we insert the
-    # continuation of the last format we replaced after our string.
-    # (Default format when we haven't replaced anything.)
-    line.insertFormat(nx, fi, lformat, lnode)
-  dec fi # go back to previous format, so that pos <= nx
-  assert line.formats[fi].pos <= nx
-  # That's it!
-
-proc setText(line: var FlexibleLine; linestr: string; x: int; format: Format;
-    node: StyledNode) =
-  assert x >= 0 and linestr.len != 0
-  var targetX = x + linestr.twidth(x)
-  var i = 0
-  var cx = line.findFirstX(x, i) # first x of new string (before padding)
-  var j = i
-  var nx = x # last x of new string
-  while nx < targetX and j < line.str.len:
-    nx += line.str.nextUTF8(j).twidth(nx)
-  let ostr = line.str.substr(j)
-  line.setTextStr(linestr, ostr, i, x, cx, nx, targetX)
-  line.setTextFormat(x, cx, nx, ostr, format, node)
-
-proc setText(grid: var FlexibleGrid; linestr: string; x, y: int; format: Format;
+type
+  # While rendering, lines are stored as one cell per terminal column, so
+  # that text and backgrounds can be painted at any position of a line in
+  # time proportional to the painted width (and not to the line's length).
+  # The result is flattened into a FlexibleGrid once rendering is done.
+  RenderCell = object
+    u: uint32 # first code point of the cell; 0 if covered by a wide char
+    fi: int32 # index into RenderGrid.formats
+
+  RenderLine = object
+    cells: seq[RenderCell]
+    # Zero-width code points, keyed by the cell they follow (-1 for the
+    # start of the line.)
+    extra: Table[int, string]
+
+  RenderGrid = object
+    lines: seq[RenderLine]
+    formats: seq[tuple[format: Format; node: StyledNode]] # 0 is the default
+
+proc addFormat(grid: var RenderGrid; format: Format; node: StyledNode):
+    int32 =
+  # Formats are almost always reused right after they were added, so it is
+  # enough to look at the last few.
+  for i in countdown(grid.formats.high, max(grid.formats.len - 8, 0)):
+    if grid.formats[i].node == node and grid.formats[i].format == format:
+      return int32(i)
+  grid.formats.add((format, node))
+  return int32(grid.formats.high)
+
+# Cells past the end of the line have the format of the last cell.
+func formatAt(line: RenderLine; x: int): int32 =
+  if x < line.cells.len:
+    return line.cells[x].fi
+  if line.cells.len > 0:
+    return line.cells[^1].fi
+  return 0
+
+proc clearExtra(line: var RenderLine; x: int) =
+  if line.extra.len > 0:
+    line.extra.del(x)
+
+proc setText(grid: var RenderGrid; linestr: string; x, y: int; format: Format;
     node: StyledNode) =
   var x = x
   var i = 0
@@ -217,12 +110,86 @@ proc setText(grid: var FlexibleGrid; linestr: string; x, y: int; format: Format;
     # highest x is outside the canvas, no need to draw
     return
   # make sure we have line y
-  if grid.high < y:
-    grid.addLines(y - grid.high)
-  if i == 0:
-    grid[y].setText(linestr, x, format, node)
-  elif i < linestr.len:
-    grid[y].setText(linestr.substr(i), x, format, node)
+  if grid.lines.high < y:
+    grid.lines.setLen(y + 1)
+  if i >= linestr.len:
+    return
+  template line: untyped = grid.lines[y]
+  let olen = line.cells.len
+  if x < olen and line.cells[x].u == 0:
+    # We are overwriting the second half of a double width char; replace its
+    # first half with padding.
+    var h = x - 1
+    while line.cells[h].u == 0:
+      dec h
+    let ofi = line.cells[h].fi
+    let padformat = Format(bgcolor: grid.formats[ofi].format.bgcolor)
+    let padfi = grid.addFormat(padformat, grid.formats[ofi].node)
+    for j in h ..< x:
+      line.clearExtra(j)
+      line.cells[j] = RenderCell(u: uint32(' '), fi: padfi)
+  elif x > olen:
+    # Pad the line with spaces up to x.
+    let ofi = line.formatAt(olen)
+    let padformat = Format(bgcolor: grid.formats[ofi].format.bgcolor)
+    let padfi = grid.addFormat(padformat, grid.formats[ofi].node)
+    line.cells.setLen(x)
+    for j in olen ..< x:
+      line.cells[j] = RenderCell(u: uint32(' '), fi: padfi)
+  # Text placed right at the end of the line does not inherit the
+  # background color of the line.
+  let inherit = x != olen
+  var cx = x
+  var ofi = -1'i32
+  var nfi = 0'i32
+  while i < linestr.len:
+    let u = linestr.nextUTF8(i)
+    let w = u.twidth(cx)
+    if w == 0:
+      line.extra.mgetOrPut(cx - 1, "").addUTF8(u)
+      continue
+    let fi = line.formatAt(cx)
+    if fi != ofi:
+      ofi = fi
+      var format = format
+      if inherit:
+        format.bgcolor = grid.formats[fi].format.bgcolor
+      nfi = grid.addFormat(format, node)
+    if line.cells.len < cx + w:
+      line.cells.setLen(cx + w)
+    line.clearExtra(cx)
+    line.cells[cx] = RenderCell(u: u, fi: nfi)
+    for j in cx + 1 ..< cx + w:
+      line.clearExtra(j)
+      line.cells[j] = RenderCell(u: 0, fi: nfi)
+    cx += w
+  # If we have only overwritten the first half of a double width char, pad
+  # out the second half with spaces.
+  while cx < line.cells.len and line.cells[cx].u == 0:
+    line.cells[cx].u = uint32(' ')
+    inc cx
+
+proc flatten(grid: RenderGrid; res: var FlexibleGrid) =
+  res.setLen(grid.lines.len)
+  for y in 0 ..< grid.lines.len:
+    template line: untyped = grid.lines[y]
+    var str = newStringOfCap(line.cells.len)
+    var formats: seq[FormatCell] = @[]
+    var pfi = 0'i32
+    if line.extra.len > 0:
+      str &= line.extra.getOrDefault(-1)
+    for x in 0 ..< line.cells.len:
+      let cell = line.cells[x]
+      if cell.fi != pfi:
+        if grid.formats[cell.fi] != grid.formats[pfi]:
+          let (format, node) = grid.formats[cell.fi]
+          formats.add(FormatCell(format: format, node: node, pos: x))
+        pfi = cell.fi
+      if cell.u != 0:
+        str.addUTF8(cell.u)
+      if line.extra.len > 0:
+        str &= line.extra.getOrDefault(x)
+    res[y] = FlexibleLine(str: move(str), formats: move(formats))
 
 type
   PosBitmap* = ref object
@@ -247,7 +214,7 @@ type
 template attrs(state: RenderState): WindowAttributes =
   state.attrsp[]
 
-proc setRowWord(grid: var FlexibleGrid; state: var RenderState;
+proc setRowWord(grid: var RenderGrid; state: var RenderState;
     word: InlineAtom; offset: Offset; format: Format; node: StyledNode) =
   let y = toInt((offset.y + word.offset.y) div state.attrs.ppl) # y cell
   if y < 0:
@@ -256,7 +223,7 @@ proc setRowWord(grid: var FlexibleGrid; state: var RenderState;
   var x = toInt((offset.x + word.offset.x) div state.attrs.ppc) # x cell
   grid.setText(word.str, x, y, format, node)
 
-proc paintBackground(grid: var FlexibleGrid; state: var RenderState;
+proc paintBackground(grid: var RenderGrid; state: var RenderState;
     color: CellColor; startx, starty, endx, endy: int; node: StyledNode) =
   var starty = starty div state.attrs.ppl
   var endy = endy div state.attrs.ppl
@@ -281,60 +248,35 @@ proc paintBackground(grid: var FlexibleGrid; state: var RenderState;
   if startx == endx: return # width is 0, no need to paint
 
   # make sure we have line y
-  if grid.high < endy:
-    grid.addLines(endy - grid.high)
+  if grid.lines.high < endy:
+    grid.lines.setLen(endy + 1)
 
   for y in starty..<endy:
+    template line: untyped = grid.lines[y]
     # Make sure line.width() >= endx
-    let linewidth = grid[y].str.width()
-    if linewidth < endx:
-      grid[y].str &= ' '.repeat(endx - linewidth)
-
-    # Process formatting around startx
-    if grid[y].formats.len == 0:
-      # No formats
-      grid[y].addFormat(startx, Format())
-    else:
-      let fi = grid[y].findFormatN(startx) - 1
-      if fi == -1:
-        # No format <= startx
-        grid[y].insertFormat(startx, 0, Format())
-      elif grid[y].formats[fi].pos == startx:
-        # Last format equals startx => next comes after, nothing to be done
-        discard
-      else:
-        # Last format lower than startx => separate format from startx
-        let copy = grid[y].formats[fi]
-        grid[y].formats[fi].pos = startx
-        grid[y].insertFormat(fi, copy)
-
-    # Process formatting around endx
-    assert grid[y].formats.len > 0
-    let fi = grid[y].findFormatN(endx) - 1
-    if fi == -1:
-      # Last format > endx -> nothing to be done
-      discard
-    elif grid[y].formats[fi].pos != endx:
-      let copy = grid[y].formats[fi]
-      if linewidth != endx:
-        grid[y].formats[fi].pos = endx
-        grid[y].insertFormat(fi, copy)
-      else:
-        grid[y].formats.delete(fi)
-        grid[y].insertFormat(fi, copy)
-
-    # Paint format backgrounds between startx and endx
-    for fi in 0..grid[y].formats.high:
-      if grid[y].formats[fi].pos >= endx:
-        break
-      if grid[y].formats[fi].pos >= startx:
-        grid[y].formats[fi].format.bgcolor = color
-        grid[y].formats[fi].node = node
-
-proc renderBlockBox(grid: var FlexibleGrid; state: var RenderState;
+    let olen = line.cells.len
+    if olen < endx:
+      let fi = line.formatAt(olen)
+      line.cells.setLen(endx)
+      for x in olen ..< endx:
+        line.cells[x] = RenderCell(u: uint32(' '), fi: fi)
+
+    # Paint cell backgrounds between startx and endx
+    var ofi = -1'i32
+    var nfi = 0'i32
+    for x in startx ..< endx:
+      let fi = line.cells[x].fi
+      if fi != ofi:
+        ofi = fi
+        var format = grid.formats[fi].format
+        format.bgcolor = color
+        nfi = grid.addFormat(format, node)
+      line.cells[x].fi = nfi
+
+proc renderBlockBox(grid: var RenderGrid; state: var RenderState;
   box: BlockBox; offset: Offset)
 
-proc paintInlineFragment(grid: var FlexibleGrid; state: var RenderState;
+proc paintInlineFragment(grid: var RenderGrid; state: var RenderState;
     fragment: InlineFragment; offset: Offset; bgcolor: CellColor) =
   for area in fragment.state.areas:
     let x1 = toInt(offset.x + area.offset.x)
@@ -343,8 +285,9 @@ proc paintInlineFragment(grid: var FlexibleGrid; state: var RenderState;
     let y2 = toInt(offset.y + area.offset.y + area.size.h)
     grid.paintBackground(state, bgcolor, x1, y1, x2, y2, fragment.node)
 
-proc renderInlineFragment(grid: var FlexibleGrid; state: var RenderState;
-    fragment: InlineFragment; offset: Offset; bgcolor0: ARGBColor) =
+proc renderInlineFragment(grid: var RenderGrid; state: var RenderState;
+    root: RootInlineFragment; fragment: InlineFragment; offset: Offset;
+    bgcolor0: ARGBColor) =
   let bgcolor = fragment.computed{"background-color"}
   var bgcolor0 = bgcolor0
   case bgcolor.t
@@ -356,10 +299,11 @@ proc renderInlineFragment(grid: var FlexibleGrid; state: var RenderState;
       grid.paintInlineFragment(state, fragment, offset, cellColor(bgcolor0))
   if fragment.t == iftParent:
     for child in fragment.children:
-      grid.renderInlineFragment(state, child, offset, bgcolor0)
+      grid.renderInlineFragment(state, root, child, offset, bgcolor0)
   else:
     let format = fragment.computed.toFormat()
-    for atom in fragment.state.atoms:
+    for i in fragment.state.atoms:
+      template atom: untyped = root.atoms[i]
       case atom.t
       of iatInlineBlock:
         grid.renderBlockBox(state, atom.innerbox, offset + atom.offset)
@@ -388,12 +332,12 @@ proc renderInlineFragment(grid: var FlexibleGrid; state: var RenderState;
       if stSplitEnd in fragment.splitType:
         discard state.absolutePos.pop()
 
-proc renderRootInlineFragment(grid: var FlexibleGrid; state: var RenderState;
+proc renderRootInlineFragment(grid: var RenderGrid; state: var RenderState;
     root: RootInlineFragment; offset: Offset) =
-  grid.renderInlineFragment(state, root.fragment, root.state.offset + offset,
-    rgba(0, 0, 0, 0))
+  grid.renderInlineFragment(state, root, root.fragment,
+    root.state.offset + offset, rgba(0, 0, 0, 0))
 
-proc renderBlockBox(grid: var FlexibleGrid; state: var RenderState;
+proc renderBlockBox(grid: var RenderGrid; state: var RenderState;
     box: BlockBox; offset: Offset) =
   var stack = newSeqOfCap[tuple[
     box: BlockBox,
@@ -457,6 +401,19 @@ proc renderBlockBox(grid: var FlexibleGrid; state: var RenderState;
       for i in countdown(box.nested.high, 0):
         stack.add((box.nested[i], offset))
 
+# Render a box tree that has already been laid out.
+proc renderDocument*(grid: var FlexibleGrid; bgcolor: var CellColor;
+    rootBox: BlockBox; attrsp: ptr WindowAttributes;
+    images: var seq[PosBitmap]) =
+  var state = RenderState(absolutePos: @[AbsolutePos()], attrsp: attrsp)
+  var rgrid = RenderGrid(formats: @[(Format(), StyledNode(nil))])
+  rgrid.renderBlockBox(state, rootBox, offset(0, 0))
+  rgrid.flatten(grid)
+  if grid.len == 0:
+    grid.setLen(1)
+  bgcolor = state.bgcolor
+  images = state.images
+
 proc renderDocument*(grid: var FlexibleGrid; bgcolor: var CellColor;
     styledRoot: StyledNode; attrsp: ptr WindowAttributes;
     images: var seq[PosBitmap]) =
@@ -464,10 +421,5 @@ proc renderDocument*(grid: var FlexibleGrid; bgcolor: var CellColor;
   if styledRoot == nil:
     # no HTML element when we run cascade; just clear all lines.
     return
-  var state = RenderState(absolutePos: @[AbsolutePos()], attrsp: attrsp)
   let rootBox = styledRoot.layout(attrsp)
-  grid.renderBlockBox(state, rootBox, offset(0, 0))
-  if grid.len == 0:
-    grid.addLines(1)
-  bgcolor = state.bgcolor
-  images = state.images
+  grid.renderDocument(bgcolor, rootBox, attrsp, images)
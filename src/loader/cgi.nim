@@ -6,6 +6,7 @@ import std/strutils
 import io/dynstream
 import io/stdio
 import loader/connecterror
+import loader/diskcache
 import loader/headers
 import loader/loaderhandle
 import loader/request
@@ -184,14 +185,25 @@ proc loadCGI*(handle: LoaderHandle; request: Request; cgiDir: seq[string];
     if pipe(pipefd_read) == -1:
       handle.sendResult(ERROR_FAIL_SETUP_CGI)
       return
+  # If the response may be stored in the disk cache, we must know whether the
+  # script has exited successfully.
+  var statusfd = [cint(-1), cint(-1)] # waiter -> parent
+  if handle.cache != nil and pipe(statusfd) == -1:
+    handle.sendResult(ERROR_FAIL_SETUP_CGI)
+    return
   let contentLen = request.body.contentLength()
   stdout.flushFile()
   stderr.flushFile()
   let pid = fork()
   if pid == -1:
+    if statusfd[0] != -1:
+      discard close(statusfd[0])
+      discard close(statusfd[1])
     handle.sendResult(ERROR_FAIL_SETUP_CGI)
   elif pid == 0:
     discard close(pipefd[0]) # close read
+    if statusfd[0] != -1:
+      discard close(statusfd[0])
     discard dup2(pipefd[1], 1) # dup stdout
     if request.body.t != rbtNone:
       discard close(pipefd_read[1]) # close write
@@ -207,6 +219,29 @@ proc loadCGI*(handle: LoaderHandle; request: Request; cgiDir: seq[string];
     # expects SIGCHLD to be untouched. (e.g. git dies a horrible death with
     # SIGCHLD as SIG_IGN)
     signal(SIGCHLD, SIG_DFL)
+    if statusfd[1] != -1:
+      # Stay around as the script's parent, and report its exit status.
+      let pid = fork()
+      if pid == -1:
+        exitnow(1) # closes statusfd without writing; the body is not stored
+      if pid != 0:
+        # only the script may hold the output pipe, so that the loader sees
+        # EOF when it exits
+        discard close(pipefd[1])
+        discard close(1)
+        discard close(0)
+        var wstatus: cint
+        var res = 1u8
+        while true:
+          if waitpid(pid, wstatus, 0) != -1:
+            if WIFEXITED(wstatus) and WEXITSTATUS(wstatus) == 0:
+              res = 0u8
+            break
+          if errno != EINTR:
+            break
+        discard write(statusfd[1], addr res, 1)
+        exitnow(0)
+      discard close(statusfd[1])
     discard execl(cstring(cmd), cstring(basename), nil)
     let code = int(ERROR_FAILED_TO_EXECUTE_CGI_SCRIPT)
     stdout.write("Cha-Control: ConnectionError " & $code & " " &
@@ -214,6 +249,9 @@ proc loadCGI*(handle: LoaderHandle; request: Request; cgiDir: seq[string];
     quit(1)
   else:
     discard close(pipefd[1]) # close write
+    if statusfd[1] != -1:
+      discard close(statusfd[1])
+      handle.cache.exitStatus = newPosixStream(statusfd[0])
     if request.body.t != rbtNone:
       discard close(pipefd_read[0]) # close read
       let ps = newPosixStream(pipefd_read[1])
@@ -256,8 +294,12 @@ proc parseHeaders0(handle: LoaderHandle; buffer: LoaderBuffer): int =
           # body comes immediately, so we haven't had a chance to send result
           # yet.
           handle.sendResult(0)
-        handle.sendStatus(parser.status)
-        handle.sendHeaders(parser.headers)
+        if handle.cache != nil and buffer != nil:
+          # the loader decides what to send, as it may answer from the cache
+          handle.cache.setResponse(parser.status, parser.headers)
+        else:
+          handle.sendStatus(parser.status)
+          handle.sendHeaders(parser.headers)
         handle.parser = nil
         return i + 1 # +1 to skip \n
       case parser.state
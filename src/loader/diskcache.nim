@@ -0,0 +1,532 @@
+# Persistent HTTP cache of the loader (RFC 9111).
+#
+# Entries (URL, status, response headers, the request headers selected by
+# Vary, and request/response times) are kept in memory. Every change is also
+# appended to an index file in the cache directory as it happens, so that a
+# crash loses nothing but the LRU order; the index is compacted on startup and
+# when the loader exits. Bodies are stored in separate files named after a
+# hash of their content, so that identical bodies served from different URLs
+# are only stored once.
+#
+# A body is only stored if the CGI script that produced it exits
+# successfully. The script is started with a waiter process as its parent,
+# which reports the exit status through the exitStatus pipe.
+#
+# This is a private cache, so "private" responses are stored too. Responses
+# that set cookies are not, so that reusing them never resurrects a cookie.
+#
+# When the bodies take up more than the configured size, the least recently
+# used entries are evicted.
+
+import std/algorithm
+import std/options
+import std/os
+import std/posix
+import std/strutils
+import std/tables
+import std/times
+
+import io/bufreader
+import io/bufwriter
+import io/dynstream
+import loader/headers
+import utils/twtstr
+
+const DiskCacheVersion = 2
+
+type
+  DiskCacheEntry* = ref object
+    url*: string
+    status*: uint16
+    headers*: Headers
+    vary*: seq[tuple[name, value: string]]
+    requestTime*: int64 # all times are in seconds since the epoch
+    responseTime*: int64
+    body*: string # name of the body file
+    size*: int
+    lastUsed*: int64
+
+  # State of a request that may be answered from, or stored in, the cache.
+  CacheRequest* = ref object
+    url: string
+    headers: Headers
+    requestTime: int64
+    stale*: DiskCacheEntry # entry being revalidated
+    hasResponse*: bool # status and respHeaders have been set
+    status*: uint16
+    respHeaders*: Headers
+    ps: PosixStream # body being stored
+    exitStatus*: PosixStream # one byte from the waiter, 0 on success
+    path: string
+    hash: uint64
+    size: int
+
+  DiskCache* = ref object
+    dir: string
+    maxSize: int
+    size: int # total size of the bodies
+    clock: int64 # for lastUsed
+    tmpNum: int
+    entries: Table[string, seq[DiskCacheEntry]] # URL -> variants
+    bodies: Table[string, int] # body name -> number of entries using it
+    journal: PosixStream # index, opened for appending; nil if unwritable
+
+  CacheDirectives = Table[string, string]
+
+const FNVOffset = 0xCBF29CE484222325u64
+const FNVPrime = 0x100000001B3u64
+
+const IndexName = "index"
+const LockName = "lock"
+
+# Statuses that may be cached without explicit freshness information.
+const HeuristicStatuses = [200u16, 203, 204, 300, 301, 404, 405, 410, 414, 501]
+
+let LOCK_EX {.importc, header: "<sys/file.h>", nodecl.}: cint
+let LOCK_NB {.importc, header: "<sys/file.h>", nodecl.}: cint
+
+proc c_flock(fd, op: cint): cint {.importc: "flock", header: "<sys/file.h>".}
+
+func unixNow(): int64 =
+  {.cast(noSideEffect).}:
+    return getTime().toUnix()
+
+# Parse an IMF-fixdate. Obsolete date formats are treated as invalid, which
+# per the RFC makes Expires mean "already expired".
+func parseHTTPDate(s: string): Option[int64] =
+  {.cast(noSideEffect).}:
+    try:
+      let dt = times.parse(s, "ddd, dd MMM yyyy HH:mm:ss 'GMT'", utc())
+      return some(dt.toTime().toUnix())
+    except ValueError:
+      return none(int64)
+
+func getDirectives(headers: Headers): CacheDirectives =
+  result = initTable[string, string]()
+  headers.table.withValue("Cache-Control", p):
+    for s in p[]:
+      for it in s.split(','):
+        let it = it.strip()
+        let i = it.find('=')
+        if i == -1:
+          result[it.toLowerAscii()] = ""
+        else:
+          let k = it.substr(0, i - 1).strip().toLowerAscii()
+          result[k] = it.substr(i + 1).strip().strip(chars = {'"'})
+
+func getSeconds(directives: CacheDirectives; k: string): Option[int64] =
+  if k in directives:
+    return parseInt64(directives[k])
+  return none(int64)
+
+func getValue(headers: Headers; k: string): string =
+  headers.table.withValue(k.toHeaderCase(), p):
+    return p[].join(", ")
+  return ""
+
+func getVaryNames(headers: Headers): seq[string] =
+  result = @[]
+  for s in headers.getValue("Vary").split(','):
+    let s = s.strip()
+    if s != "":
+      result.add(s.toHeaderCase())
+
+func matches(entry: DiskCacheEntry; headers: Headers): bool =
+  for it in entry.vary:
+    if headers.getValue(it.name) != it.value:
+      return false
+  return true
+
+# RFC 9111, 4.2.1.
+func freshnessLifetime(entry: DiskCacheEntry): int64 =
+  let directives = entry.headers.getDirectives()
+  let maxAge = directives.getSeconds("max-age")
+  if maxAge.isSome:
+    return maxAge.get
+  let date = parseHTTPDate(entry.headers.getOrDefault("Date"))
+    .get(entry.responseTime)
+  if "Expires" in entry.headers:
+    let expires = parseHTTPDate(entry.headers.getOrDefault("Expires"))
+    if expires.isNone:
+      return 0
+    return expires.get - date
+  if entry.status in HeuristicStatuses or "public" in directives:
+    let lastModified = entry.headers.getOrDefault("Last-Modified")
+      .parseHTTPDate()
+    if lastModified.isSome:
+      # 10% of the time since the last modification
+      return max(date - lastModified.get, 0) div 10
+  return 0
+
+# RFC 9111, 4.2.3.
+func currentAge(entry: DiskCacheEntry): int64 =
+  let date = parseHTTPDate(entry.headers.getOrDefault("Date"))
+    .get(entry.responseTime)
+  let apparentAge = max(entry.responseTime - date, 0)
+  let responseDelay = entry.responseTime - entry.requestTime
+  let ageValue = parseInt64(entry.headers.getOrDefault("Age")).get(0)
+  let correctedInitialAge = max(apparentAge, ageValue + responseDelay)
+  return correctedInitialAge + unixNow() - entry.responseTime
+
+# Whether the entry may be used without contacting the server.
+func isFresh(entry: DiskCacheEntry; headers: Headers): bool =
+  let directives = entry.headers.getDirectives()
+  if "no-cache" in directives:
+    return false
+  let age = entry.currentAge()
+  let lifetime = entry.freshnessLifetime()
+  if age >= lifetime:
+    return false
+  # Immutable responses are not revalidated while fresh, even if the request
+  # asks for it. (Our default headers always do.)
+  if "immutable" in directives:
+    return true
+  let reqDirectives = headers.getDirectives()
+  if "no-cache" in reqDirectives or "Cache-Control" notin headers and
+      headers.getOrDefault("Pragma") == "no-cache":
+    return false
+  let maxAge = reqDirectives.getSeconds("max-age")
+  if maxAge.isSome and age > maxAge.get:
+    return false
+  let minFresh = reqDirectives.getSeconds("min-fresh")
+  if minFresh.isSome and lifetime - age < minFresh.get:
+    return false
+  return true
+
+proc bodyPath(cache: DiskCache; name: string): string =
+  return cache.dir / name
+
+func sameVariant(a, b: DiskCacheEntry): bool =
+  return a.url == b.url and a.vary == b.vary
+
+# Append a record of an entry being added (or replaced) or removed to the
+# index. Each record is a packet of a bool (true for added) and the entry.
+proc appendRecord(cache: DiskCache; added: bool; entry: DiskCacheEntry) =
+  if cache.journal == nil:
+    return
+  try:
+    cache.journal.withPacketWriter w:
+      w.swrite(added)
+      w.swrite(entry)
+  except IOError:
+    cache.journal.sclose()
+    cache.journal = nil
+
+proc removeEntry(cache: DiskCache; entry: DiskCacheEntry) =
+  var empty = false
+  cache.entries.withValue(entry.url, p):
+    let i = p[].find(entry)
+    if i != -1:
+      p[].del(i)
+    empty = p[].len == 0
+  if empty:
+    cache.entries.del(entry.url)
+  let refc = cache.bodies.getOrDefault(entry.body) - 1
+  if refc > 0:
+    cache.bodies[entry.body] = refc
+  else:
+    discard unlink(cstring(cache.bodyPath(entry.body)))
+    cache.bodies.del(entry.body)
+    cache.size -= entry.size
+
+proc addEntry(cache: DiskCache; entry: DiskCacheEntry) =
+  cache.entries.mgetOrPut(entry.url, @[]).add(entry)
+  cache.bodies.withValue(entry.body, p):
+    inc p[]
+  do:
+    cache.bodies[entry.body] = 1
+    cache.size += entry.size
+
+# Evict least recently used entries until the bodies take up at most 90% of
+# maxSize, so that we do not have to do this again on the next store.
+proc evict(cache: DiskCache) =
+  if cache.size <= cache.maxSize:
+    return
+  var all: seq[DiskCacheEntry] = @[]
+  for entries in cache.entries.values:
+    for entry in entries:
+      all.add(entry)
+  all.sort(proc(a, b: DiskCacheEntry): int = cmp(a.lastUsed, b.lastUsed))
+  let target = cache.maxSize div 10 * 9
+  for entry in all:
+    if cache.size <= target:
+      break
+    cache.removeEntry(entry)
+    cache.appendRecord(added = false, entry)
+
+proc touch(cache: DiskCache; entry: DiskCacheEntry) =
+  inc cache.clock
+  entry.lastUsed = cache.clock
+
+# Replay the records of the index.
+proc loadIndex(cache: DiskCache) =
+  let ps = newPosixStream(cache.dir / IndexName, O_RDONLY, 0)
+  if ps == nil:
+    return
+  var entries = initTable[string, seq[DiskCacheEntry]]()
+  try:
+    var version: int
+    ps.withPacketReader r:
+      r.sread(version)
+    if version == DiskCacheVersion:
+      while true:
+        var added: bool
+        var entry: DiskCacheEntry
+        ps.withPacketReader r:
+          r.sread(added)
+          r.sread(entry)
+        var variants = entries.getOrDefault(entry.url)
+        for i, it in variants:
+          if it.sameVariant(entry):
+            variants.del(i)
+            break
+        if added:
+          variants.add(entry)
+        entries[entry.url] = move(variants)
+  except IOError: # EOF, or a record cut short by a crash
+    discard
+  ps.sclose()
+  for variants in entries.values:
+    for entry in variants:
+      if fileExists(cache.bodyPath(entry.body)):
+        cache.addEntry(entry)
+        cache.clock = max(cache.clock, entry.lastUsed)
+
+# Remove bodies that no entry refers to, e.g. because the loader crashed
+# between storing a body and appending its entry to the index.
+proc removeOrphans(cache: DiskCache) =
+  for kind, path in walkDir(cache.dir, relative = true):
+    if kind == pcFile and path notin [IndexName, LockName] and
+        path notin cache.bodies:
+      discard unlink(cstring(cache.dir / path))
+
+# Rewrite the index with one record per entry, and reopen it for appending.
+proc save*(cache: DiskCache) =
+  if cache.journal != nil:
+    cache.journal.sclose()
+    cache.journal = nil
+  let tmp = cache.dir / IndexName & ".tmp"
+  let ps = newPosixStream(tmp, O_CREAT or O_WRONLY or O_TRUNC, 0o600)
+  if ps == nil:
+    return
+  try:
+    ps.withPacketWriter w:
+      w.swrite(DiskCacheVersion)
+    for entries in cache.entries.values:
+      for entry in entries:
+        ps.withPacketWriter w:
+          w.swrite(true)
+          w.swrite(entry)
+  except IOError:
+    ps.sclose()
+    discard unlink(cstring(tmp))
+    return
+  ps.sclose()
+  let path = cache.dir / IndexName
+  if rename(cstring(tmp), cstring(path)) == 0:
+    cache.journal = newPosixStream(path, O_WRONLY or O_APPEND, 0)
+
+# Returns nil if the cache directory cannot be used, e.g. because another
+# instance is using it.
+proc openDiskCache*(dir: string; maxSize: int): DiskCache =
+  try:
+    createDir(dir)
+  except OSError:
+    return nil
+  # the lock is released when the loader exits
+  let fd = open(cstring(dir / LockName), O_CREAT or O_RDWR or O_CLOEXEC, 0o600)
+  if fd == -1:
+    return nil
+  if c_flock(fd, LOCK_EX or LOCK_NB) == -1:
+    discard close(fd)
+    return nil
+  let cache = DiskCache(dir: dir, maxSize: maxSize)
+  cache.loadIndex()
+  cache.removeOrphans()
+  cache.evict()
+  cache.save()
+  return cache
+
+# Look up a GET request. Returns nil if the request must bypass the cache.
+# Otherwise, the stored response matching the request (if any) is set as
+# stale; canUseStored tells if it is in fact still fresh.
+proc newCacheRequest*(cache: DiskCache; url: string; headers: Headers):
+    CacheRequest =
+  if "no-store" in headers.getDirectives() or "Range" in headers or
+      "If-None-Match" in headers or "If-Modified-Since" in headers:
+    # either explicitly uncached, or the client handles caching itself
+    return nil
+  let creq = CacheRequest(url: url, headers: headers, requestTime: unixNow())
+  cache.entries.withValue(url, p):
+    for entry in p[]:
+      if entry.matches(headers):
+        creq.stale = entry
+        break
+  return creq
+
+func canUseStored*(creq: CacheRequest): bool =
+  return creq.stale != nil and creq.stale.isFresh(creq.headers)
+
+# Add validators of the stored entry to the request headers, so that the
+# server may answer with 304 Not Modified.
+proc addValidators*(creq: CacheRequest; headers: Headers) =
+  let entry = creq.stale
+  if entry == nil:
+    return
+  let etag = entry.headers.getOrDefault("ETag")
+  let lastModified = entry.headers.getOrDefault("Last-Modified")
+  if etag == "" and lastModified == "":
+    creq.stale = nil # nothing to revalidate with
+    return
+  if etag != "":
+    headers["If-None-Match"] = etag
+  if lastModified != "":
+    headers["If-Modified-Since"] = lastModified
+
+proc openBody*(cache: DiskCache; entry: DiskCacheEntry): PosixStream =
+  cache.touch(entry)
+  return newPosixStream(cache.bodyPath(entry.body), O_RDONLY, 0)
+
+proc setResponse*(creq: CacheRequest; status: uint16; headers: Headers) =
+  creq.status = status
+  creq.respHeaders = headers
+  creq.hasResponse = true
+
+# Update the stored entry with the headers of a 304 response, and return it.
+proc revalidated*(cache: DiskCache; creq: CacheRequest): DiskCacheEntry =
+  let entry = creq.stale
+  for k, v in creq.respHeaders.table:
+    if k notin ["Content-Length", "Content-Encoding", "Transfer-Encoding"]:
+      entry.headers.table[k] = v
+  entry.requestTime = creq.requestTime
+  entry.responseTime = unixNow()
+  cache.appendRecord(added = true, entry)
+  return entry
+
+proc closeExitStatus(creq: CacheRequest) =
+  if creq.exitStatus != nil:
+    creq.exitStatus.sclose()
+    creq.exitStatus = nil
+
+proc abort*(creq: CacheRequest) =
+  creq.closeExitStatus()
+  if creq.ps != nil:
+    creq.ps.sclose()
+    creq.ps = nil
+    discard unlink(cstring(creq.path))
+
+# Start storing the response body, if the response may be stored.
+# Returns false if it may not.
+proc startStore*(cache: DiskCache; creq: CacheRequest): bool =
+  let headers = creq.respHeaders
+  let directives = headers.getDirectives()
+  if "no-store" in directives or "Set-Cookie" in headers:
+    return false
+  if creq.status notin HeuristicStatuses and "max-age" notin directives and
+      "Expires" notin headers:
+    return false
+  for name in headers.getVaryNames():
+    if name == "*":
+      return false
+  while true:
+    creq.path = cache.dir / "tmp" & $getCurrentProcessId() & "-" &
+      $cache.tmpNum
+    inc cache.tmpNum
+    if not fileExists(creq.path):
+      break
+  creq.ps = newPosixStream(creq.path, O_CREAT or O_WRONLY or O_EXCL, 0o600)
+  creq.hash = FNVOffset
+  return creq.ps != nil
+
+proc write*(cache: DiskCache; creq: CacheRequest; p: ptr UncheckedArray[uint8];
+    si, ei: int) =
+  if creq.ps == nil:
+    return
+  # do not let a single body take up most of the cache
+  if creq.size + ei - si > cache.maxSize div 8:
+    creq.abort()
+    return
+  try:
+    creq.ps.sendDataLoop(addr p[si], ei - si)
+  except IOError:
+    creq.abort()
+    return
+  for i in si ..< ei:
+    creq.hash = (creq.hash xor uint64(p[i])) * FNVPrime
+  creq.size += ei - si
+
+proc sameContents(a, b: string): bool =
+  let fa = open(cstring(a), O_RDONLY)
+  let fb = open(cstring(b), O_RDONLY)
+  result = fa != -1 and fb != -1
+  var ba {.noinit.}: array[4096, uint8]
+  var bb {.noinit.}: array[4096, uint8]
+  while result:
+    let n = read(fa, addr ba[0], ba.len)
+    if n <= 0:
+      break
+    var m = 0
+    while m < n:
+      let k = read(fb, addr bb[m], n - m)
+      if k <= 0:
+        break
+      m += k
+    result = m == n and equalMem(addr ba[0], addr bb[0], n)
+  if fa != -1:
+    discard close(fa)
+  if fb != -1:
+    discard close(fb)
+
+# The whole body has been received, and the script has exited successfully;
+# add the entry to the cache.
+proc commit*(cache: DiskCache; creq: CacheRequest) =
+  creq.closeExitStatus()
+  if creq.ps == nil:
+    return
+  creq.ps.sclose()
+  creq.ps = nil
+  let contentLength = creq.respHeaders.getOrDefault("Content-Length")
+  if contentLength != "" and "Content-Encoding" notin creq.respHeaders and
+      parseInt64(contentLength).get(-1) != creq.size:
+    # the transfer was cut short
+    discard unlink(cstring(creq.path))
+    return
+  let base = creq.hash.toHex() & "-" & $creq.size
+  var name = base
+  var i = 0
+  while true:
+    if name notin cache.bodies:
+      if rename(cstring(creq.path), cstring(cache.bodyPath(name))) != 0:
+        discard unlink(cstring(creq.path))
+        return
+      break
+    if sameContents(creq.path, cache.bodyPath(name)):
+      # deduplicate
+      discard unlink(cstring(creq.path))
+      break
+    inc i
+    name = base & "-" & $i
+  let entry = DiskCacheEntry(
+    url: creq.url,
+    status: creq.status,
+    headers: creq.respHeaders.clone(),
+    requestTime: creq.requestTime,
+    responseTime: unixNow(),
+    body: name,
+    size: creq.size
+  )
+  for it in creq.respHeaders.getVaryNames():
+    entry.vary.add((it, creq.headers.getValue(it)))
+  var old: DiskCacheEntry = nil
+  cache.entries.withValue(creq.url, p):
+    for it in p[]:
+      if it.matches(creq.headers):
+        old = it
+        break
+  if old != nil:
+    cache.removeEntry(old)
+    cache.appendRecord(added = false, old)
+  cache.touch(entry)
+  cache.addEntry(entry)
+  cache.appendRecord(added = true, entry)
+  cache.evict()
@@ -39,8 +39,10 @@ import io/tempfile
 import io/urlfilter
 import loader/cgi
 import loader/connecterror
+import loader/diskcache
 import loader/headers
 import loader/loaderhandle
+import loader/memcache
 import loader/request
 import loader/response
 import monoucha/javascript
@@ -89,6 +91,7 @@ type
     lcGetCacheFile
     lcLoad
     lcLoadConfig
+    lcOpenCachedItem
     lcPassFd
     lcRedirectToFile
     lcRemoveCachedItem
@@ -126,6 +129,15 @@ type
     clientData: Table[int, ClientData] # pid -> data
     # ID of next output. TODO: find a better allocation scheme
     outputNum: int
+    # HTTP cache; nil if disabled.
+    diskCache: DiskCache
+    # Cache requests whose body has been received in full, waiting for the
+    # exit status of the script. Keyed by the fd of exitStatus.
+    pendingCommits: Table[int, CacheRequest]
+    # Read end of the pipe the SIGTERM handler writes to.
+    termFd: cint
+    # Contents of small cache files; nil if disabled.
+    memCache: MemCache
 
   LoaderConfig* = object
     cgiDir*: seq[string]
@@ -133,6 +145,9 @@ type
     w3mCGICompat*: bool
     tmpdir*: string
     sockdir*: string
+    cacheDir*: string
+    cacheSize*: int # in bytes; 0 disables the HTTP cache
+    memoryCacheSize*: int # in bytes; 0 disables the in-memory tier
 
   LoaderClientConfig* = object
     cookieJar*: CookieJar
@@ -315,6 +330,33 @@ proc addFd(ctx: LoaderContext; handle: LoaderHandle) =
 type HandleReadResult = enum
   hrrDone, hrrUnregister, hrrBrokenPipe
 
+proc onCacheResponse(ctx: LoaderContext; handle: LoaderHandle): bool
+
+# The body of creq has been received in full. Store it once the script has
+# reported its exit status.
+proc finishCacheRequest(ctx: LoaderContext; creq: CacheRequest) =
+  if creq.exitStatus == nil:
+    ctx.diskCache.commit(creq)
+  else:
+    let fd = int(creq.exitStatus.fd)
+    ctx.selector.registerHandle(fd, {Read}, 0)
+    ctx.pendingCommits[fd] = creq
+
+proc onExitStatus(ctx: LoaderContext; fd: int) =
+  var creq: CacheRequest
+  if ctx.pendingCommits.pop(fd, creq):
+    ctx.selector.unregister(fd)
+    var res = 1u8
+    try:
+      if creq.exitStatus.recvData(addr res, 1) != 1:
+        res = 1u8 # the waiter died
+    except IOError:
+      discard
+    if res == 0:
+      ctx.diskCache.commit(creq)
+    else:
+      creq.abort()
+
 # Called whenever there is more data available to read.
 proc handleRead(ctx: LoaderContext; handle: LoaderHandle;
     unregWrite: var seq[OutputHandle]): HandleReadResult =
@@ -325,14 +367,22 @@ proc handleRead(ctx: LoaderContext; handle: LoaderHandle;
     try:
       let n = handle.istream.recvData(buffer)
       if n == 0: # EOF
+        if handle.cache != nil:
+          ctx.finishCacheRequest(handle.cache)
+          handle.cache = nil
         return hrrUnregister
       var si = 0
       if handle.parser != nil:
         si = handle.parseHeaders(buffer)
         if si == -1: # died while parsing headers; unregister
           return hrrUnregister
+        if handle.cache != nil and handle.cache.hasResponse:
+          if ctx.onCacheResponse(handle):
+            return hrrDone # answered from the disk cache
         if si == n: # parsed the entire buffer as headers; skip output handling
           continue
+      if handle.cache != nil:
+        ctx.diskCache.write(handle.cache, buffer.page, si, n)
       for output in handle.outputs:
         if output.dead:
           # do not push to unregWrite candidates
@@ -385,6 +435,63 @@ proc loadStreamRegular(ctx: LoaderContext; handle, cachedHandle: LoaderHandle) =
   handle.outputs.setLen(0)
   handle.iclose()
 
+# Called when the response headers of a request that may use the disk cache
+# have been parsed. If the server says that our stored response is still
+# valid, its body is streamed instead of the CGI script's output, and true is
+# returned.
+proc onCacheResponse(ctx: LoaderContext; handle: LoaderHandle): bool =
+  let creq = handle.cache
+  creq.hasResponse = false
+  if creq.status == 304 and creq.stale != nil:
+    let entry = ctx.diskCache.revalidated(creq)
+    let ps = ctx.diskCache.openBody(entry)
+    if ps != nil:
+      creq.abort()
+      handle.cache = nil
+      handle.sendStatus(entry.status)
+      handle.sendHeaders(entry.headers.clone())
+      ctx.unregister(handle)
+      ctx.handleMap.del(handle.istream.fd)
+      handle.istream.sclose()
+      handle.istream = ps
+      for output in handle.outputs:
+        ctx.outputMap.del(output.ostream.fd)
+      ctx.loadStreamRegular(handle, nil)
+      return true
+  handle.sendStatus(creq.status)
+  handle.sendHeaders(creq.respHeaders)
+  if not ctx.diskCache.startStore(creq):
+    creq.abort()
+    handle.cache = nil
+  return false
+
+# Answer an HTTP GET request from the disk cache if a fresh response is
+# stored. Otherwise, prepare the request for revalidating a stale response
+# and for storing the new one.
+proc loadFromDiskCache(ctx: LoaderContext; handle: LoaderHandle;
+    request: Request): bool =
+  if request.httpMethod != hmGet or request.body.t != rbtNone or
+      request.url.scheme notin ["http", "https"]:
+    return false
+  let url = request.url.serialize(excludefragment = true)
+  let creq = ctx.diskCache.newCacheRequest(url, request.headers)
+  if creq == nil:
+    return false
+  if creq.canUseStored():
+    let entry = creq.stale
+    let ps = ctx.diskCache.openBody(entry)
+    if ps != nil:
+      handle.sendResult(0)
+      handle.sendStatus(entry.status)
+      handle.sendHeaders(entry.headers.clone())
+      handle.istream = ps
+      handle.output.ostream.setBlocking(false)
+      ctx.loadStreamRegular(handle, nil)
+      return true
+  creq.addValidators(request.headers)
+  handle.cache = creq
+  return false
+
 proc loadStream(ctx: LoaderContext; client: ClientData; handle: LoaderHandle;
     request: Request) =
   client.passedFdMap.withValue(request.url.pathname, fdp):
@@ -405,6 +512,31 @@ proc loadStream(ctx: LoaderContext; client: ClientData; handle: LoaderHandle;
   do:
     handle.sendResult(ERROR_FILE_NOT_FOUND, "stream not found")
 
+# Send the entire body of a response whose headers have already been sent.
+proc sendBody(ctx: LoaderContext; handle: LoaderHandle; s: openArray[char]) =
+  let output = handle.output
+  if s.len == 0:
+    if output.suspended:
+      output.istreamAtEnd = true
+      ctx.outputMap[output.ostream.fd] = output
+    else:
+      output.oclose()
+    return
+  let buffer = newLoaderBuffer(size = s.len)
+  buffer.len = s.len
+  copyMem(buffer.page, unsafeAddr s[0], s.len)
+  case ctx.pushBuffer(output, buffer, 0)
+  of pbrUnregister:
+    if output.registered:
+      ctx.unregister(output)
+    output.oclose()
+  of pbrDone:
+    if output.registered or output.suspended:
+      output.istreamAtEnd = true
+      ctx.outputMap[output.ostream.fd] = output
+    else:
+      output.oclose()
+
 func find(cacheMap: seq[CachedItem]; id: int): int =
   for i, it in cacheMap:
     if it.id == id:
@@ -420,6 +552,22 @@ proc loadFromCache(ctx: LoaderContext; client: ClientData; handle: LoaderHandle;
     0
   let n = client.cacheMap.find(id)
   if n != -1:
+    let cachedHandle = ctx.findCachedHandle(id)
+    if ctx.memCache != nil and cachedHandle == nil:
+      # The file is complete, so it may be answered from memory.
+      let item = ctx.memCache.get(client.cacheMap[n].path)
+      if item != nil:
+        handle.sendResult(0)
+        handle.sendStatus(200)
+        handle.sendHeaders(newHeaders())
+        handle.output.ostream.setBlocking(false)
+        let startFrom = min(int(startFrom), item.data.len)
+        ctx.sendBody(handle, item.data.toOpenArray(startFrom, item.data.high))
+        # detach the output, so that closing the handle leaves it alone
+        for output in handle.outputs:
+          output.parent = nil
+        handle.outputs.setLen(0)
+        return
     let ps = newPosixStream(client.cacheMap[n].path, O_RDONLY, 0)
     if startFrom != 0:
       ps.seek(startFrom)
@@ -432,7 +580,6 @@ proc loadFromCache(ctx: LoaderContext; client: ClientData; handle: LoaderHandle;
     handle.sendStatus(200)
     handle.sendHeaders(newHeaders())
     handle.output.ostream.setBlocking(false)
-    let cachedHandle = ctx.findCachedHandle(id)
     ctx.loadStreamRegular(handle, cachedHandle)
   else:
     handle.sendResult(ERROR_URL_NOT_IN_CACHE)
@@ -444,28 +591,7 @@ proc loadDataSend(ctx: LoaderContext; handle: LoaderHandle; s, ct: string) =
   handle.sendResult(0)
   handle.sendStatus(200)
   handle.sendHeaders(newHeaders({"Content-Type": ct}))
-  let output = handle.output
-  if s.len == 0:
-    if output.suspended:
-      output.istreamAtEnd = true
-      ctx.outputMap[output.ostream.fd] = output
-    else:
-      output.oclose()
-    return
-  let buffer = newLoaderBuffer(size = s.len)
-  buffer.len = s.len
-  copyMem(buffer.page, unsafeAddr s[0], s.len)
-  case ctx.pushBuffer(output, buffer, 0)
-  of pbrUnregister:
-    if output.registered:
-      ctx.unregister(output)
-    output.oclose()
-  of pbrDone:
-    if output.registered or output.suspended:
-      output.istreamAtEnd = true
-      ctx.outputMap[output.ostream.fd] = output
-    else:
-      output.oclose()
+  ctx.sendBody(handle, s)
 
 proc loadData(ctx: LoaderContext; handle: LoaderHandle; request: Request) =
   let url = request.url
@@ -489,6 +615,10 @@ proc loadData(ctx: LoaderContext; handle: LoaderHandle; request: Request) =
 
 proc loadResource(ctx: LoaderContext; client: ClientData;
     config: LoaderClientConfig; request: Request; handle: LoaderHandle) =
+  if ctx.diskCache != nil and ctx.loadFromDiskCache(handle, request):
+    assert handle.istream == nil
+    handle.close()
+    return
   var redo = true
   var tries = 0
   var prevurl: URL = nil
@@ -601,6 +731,25 @@ proc getCacheFile(ctx: LoaderContext; stream: SocketStream; client: ClientData;
     else:
       w.swrite("")
 
+# Send a read-only file descriptor of a cached item to the client.
+# (Buffers cannot open files themselves.)
+proc openCachedItem(ctx: LoaderContext; stream: SocketStream;
+    client: ClientData; r: var BufferedReader) =
+  var cacheId: int
+  r.sread(cacheId)
+  let n = client.cacheMap.find(cacheId)
+  let fd = if n != -1:
+    open(cstring(client.cacheMap[n].path), O_RDONLY)
+  else:
+    -1
+  stream.withPacketWriter w:
+    w.swrite(fd != -1)
+    if fd != -1:
+      w.sendAux.add(FileHandle(fd))
+  if fd != -1:
+    discard close(fd)
+  stream.sclose()
+
 proc addClient(ctx: LoaderContext; stream: SocketStream;
     r: var BufferedReader) =
   var key: ClientKey
@@ -625,11 +774,16 @@ proc addClient(ctx: LoaderContext; stream: SocketStream;
       w.swrite(true)
   stream.sclose()
 
-proc cleanup(client: ClientData) =
+proc unlinkCachedItem(ctx: LoaderContext; item: CachedItem) =
+  if ctx.memCache != nil:
+    ctx.memCache.remove(item.path)
+  discard unlink(cstring(item.path))
+
+proc cleanup(ctx: LoaderContext; client: ClientData) =
   for it in client.cacheMap:
     dec it.refc
     if it.refc == 0:
-      discard unlink(cstring(it.path))
+      ctx.unlinkCachedItem(it)
 
 proc removeClient(ctx: LoaderContext; stream: SocketStream;
     r: var BufferedReader) =
@@ -637,7 +791,7 @@ proc removeClient(ctx: LoaderContext; stream: SocketStream;
   r.sread(pid)
   if pid in ctx.clientData:
     let client = ctx.clientData[pid]
-    client.cleanup()
+    ctx.cleanup(client)
     ctx.clientData.del(pid)
   stream.sclose()
 
@@ -684,9 +838,10 @@ proc shareCachedItem(ctx: LoaderContext; stream: SocketStream;
   let sourceClient = ctx.clientData[sourcePid]
   let targetClient = ctx.clientData[targetPid]
   let n = sourceClient.cacheMap.find(id)
-  let item = sourceClient.cacheMap[n]
-  inc item.refc
-  targetClient.cacheMap.add(item)
+  if n != -1: # may have been removed since, e.g. a superseded canvas frame
+    let item = sourceClient.cacheMap[n]
+    inc item.refc
+    targetClient.cacheMap.add(item)
   stream.sclose()
 
 proc passFd(ctx: LoaderContext; stream: SocketStream; client: ClientData;
@@ -707,7 +862,7 @@ proc removeCachedItem(ctx: LoaderContext; stream: SocketStream;
     client.cacheMap.del(n)
     dec item.refc
     if item.refc == 0:
-      discard unlink(cstring(item.path))
+      ctx.unlinkCachedItem(item)
   stream.sclose()
 
 proc tee(ctx: LoaderContext; stream: SocketStream; client: ClientData;
@@ -809,6 +964,8 @@ proc acceptConnection(ctx: LoaderContext) =
         ctx.addCacheFile(stream, client, r)
       of lcRemoveCachedItem:
         ctx.removeCachedItem(stream, client, r)
+      of lcOpenCachedItem:
+        ctx.openCachedItem(stream, client, r)
       of lcPassFd:
         ctx.passFd(stream, client, r)
       of lcLoad:
@@ -826,18 +983,24 @@ proc acceptConnection(ctx: LoaderContext) =
 
 proc exitLoader(ctx: LoaderContext) =
   ctx.ssock.close()
+  for creq in ctx.pendingCommits.values:
+    creq.abort()
+  if ctx.diskCache != nil:
+    ctx.diskCache.save()
   for client in ctx.clientData.values:
-    client.cleanup()
+    ctx.cleanup(client)
   exitnow(1)
 
-var gctx: LoaderContext
+# Write end of the SIGTERM pipe. The handler only writes to it; the event
+# loop then exits and saves the cache index.
+var gtermFd = cint(-1)
 proc initLoaderContext(fd: cint; config: LoaderConfig): LoaderContext =
   var ctx = LoaderContext(
     alive: true,
     config: config,
-    selector: newSelector[int]()
+    selector: newSelector[int](),
+    termFd: -1
   )
-  gctx = ctx
   let myPid = getCurrentProcessId()
   # we don't capsicumize loader, so -1 is appropriate here
   ctx.ssock = initServerSocket(config.sockdir, -1, myPid, blocking = true)
@@ -847,12 +1010,23 @@ proc initLoaderContext(fd: cint; config: LoaderConfig): LoaderContext =
   let ps = newPosixStream(fd)
   ps.write(char(0u8))
   ps.sclose()
+  var termfd {.noinit.}: array[2, cint]
+  if pipe(termfd) != -1:
+    discard fcntl(termfd[1], F_SETFL, fcntl(termfd[1], F_GETFL) or O_NONBLOCK)
+    ctx.termFd = termfd[0]
+    gtermFd = termfd[1]
+    ctx.selector.registerHandle(int(ctx.termFd), {Read}, 0)
   onSignal SIGTERM:
     discard sig
-    gctx.exitLoader()
+    var c = '\0'
+    discard write(gtermFd, addr c, 1)
   for dir in ctx.config.cgiDir.mitems:
     if dir.len > 0 and dir[^1] != '/':
       dir &= '/'
+  if config.cacheSize > 0 and config.cacheDir != "":
+    ctx.diskCache = openDiskCache(config.cacheDir, config.cacheSize)
+  if config.memoryCacheSize > 0:
+    ctx.memCache = newMemCache(config.memoryCacheSize)
   # get pager's key
   let stream = ctx.ssock.acceptSocketStream()
   stream.withPacketReader r:
@@ -962,6 +1136,10 @@ proc runFileLoader*(fd: cint; config: LoaderConfig) =
       if Read in event.events:
         if event.fd == fd: # incoming connection
           ctx.acceptConnection()
+        elif event.fd == ctx.termFd:
+          ctx.alive = false
+        elif event.fd in ctx.pendingCommits:
+          ctx.onExitStatus(event.fd)
         else:
           let handle = ctx.handleMap[event.fd]
           case ctx.handleRead(handle, unregWrite)
@@ -971,11 +1149,15 @@ proc runFileLoader*(fd: cint; config: LoaderConfig) =
         ctx.handleWrite(ctx.outputMap[event.fd], unregWrite)
       if Error in event.events:
         assert event.fd != fd
+        if event.fd in ctx.pendingCommits:
+          ctx.onExitStatus(event.fd)
+          continue
         ctx.outputMap.withValue(event.fd, outputp): # ostream died
           unregWrite.add(outputp[])
         do: # istream died
-          let handle = ctx.handleMap[event.fd]
-          unregRead.add(handle)
+          # (unless it was replaced by a cached body in handleRead)
+          ctx.handleMap.withValue(event.fd, handlep):
+            unregRead.add(handlep[])
     ctx.finishCycle(unregRead, unregWrite)
   ctx.exitLoader()
 
@@ -1106,6 +1288,22 @@ proc getCacheFile*(loader: FileLoader; cacheId: int): string =
   stream.sclose()
   return s
 
+# Returns a read-only fd of the cached item, or -1 if it was not found.
+proc openCachedItem*(loader: FileLoader; cacheId: int): cint =
+  let stream = loader.connect()
+  if stream == nil:
+    return -1
+  stream.withLoaderPacketWriter loader, w:
+    w.swrite(lcOpenCachedItem)
+    w.swrite(cacheId)
+  var r = stream.initPacketReader()
+  var success: bool
+  r.sread(success)
+  stream.sclose()
+  if not success:
+    return -1
+  return cint(r.recvAux.pop())
+
 proc redirectToFile*(loader: FileLoader; outputId: int; targetPath: string):
     bool =
   let stream = loader.connect()
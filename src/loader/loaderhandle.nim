@@ -4,6 +4,7 @@ import std/tables
 
 import io/bufwriter
 import io/dynstream
+import loader/diskcache
 import loader/headers
 
 when defined(debug):
@@ -52,6 +53,7 @@ type
     outputs*: seq[OutputHandle] # list of outputs to be streamed into
     cacheId*: int # if cached, our ID in a client cacheMap
     parser*: HeaderParser # only exists for CGI handles
+    cache*: CacheRequest # for HTTP requests, if the disk cache is enabled
     rstate: ResponseState # track response state
     registered*: bool # track registered state
     when defined(debug):
@@ -175,6 +177,10 @@ proc sendData*(ps: PosixStream; buffer: LoaderBuffer; si = 0): int {.inline.} =
   return ps.sendData(addr buffer.page[si], buffer.len - si)
 
 proc iclose*(handle: LoaderHandle) =
+  if handle.cache != nil:
+    # the body was not received in full
+    handle.cache.abort()
+    handle.cache = nil
   if handle.istream != nil:
     assert not handle.registered
     if handle.rstate notin {rsBeforeResult, rsAfterFailure, rsAfterHeaders}:
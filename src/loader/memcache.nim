@@ -0,0 +1,73 @@
+# In-memory tier in front of the loader's cache files.
+#
+# Small files are kept in memory after they have been read once, so that
+# repeated `cache:' loads (back/forward navigation, clone, images shared
+# between buffers) are answered without touching the file. Items are evicted
+# in least recently used order once they take up more than maxSize bytes.
+#
+# Only complete files may be added, and the loader must remove an item
+# before it unlinks the file, as the path may be reused afterwards.
+
+import std/lists
+import std/posix
+import std/tables
+
+type
+  MemCacheItem* = ref object
+    path: string
+    data*: string
+
+  MemCache* = ref object
+    maxSize: int
+    maxItemSize: int
+    size: int
+    map: Table[string, DoublyLinkedNode[MemCacheItem]]
+    lru: DoublyLinkedList[MemCacheItem] # most recently used first
+
+proc newMemCache*(maxSize: int): MemCache =
+  return MemCache(maxSize: maxSize, maxItemSize: maxSize div 16)
+
+proc remove*(cache: MemCache; path: string) =
+  var node: DoublyLinkedNode[MemCacheItem]
+  if cache.map.pop(path, node):
+    cache.lru.remove(node)
+    cache.size -= node.value.data.len
+
+proc readSmallFile(path: string; maxLen: int; s: var string): bool =
+  let fd = open(cstring(path), O_RDONLY)
+  if fd == -1:
+    return false
+  var stats: Stat
+  var res = false
+  if fstat(fd, stats) != -1 and int(stats.st_size) <= maxLen:
+    s = newString(int(stats.st_size))
+    var n = 0
+    while n < s.len:
+      let k = read(fd, addr s[n], s.len - n)
+      if k <= 0:
+        break
+      n += k
+    res = n == s.len
+  discard close(fd)
+  return res
+
+# Get the contents of the file at path, reading it if it is not in memory
+# yet. Returns nil if the file is too large to keep in memory.
+proc get*(cache: MemCache; path: string): MemCacheItem =
+  cache.map.withValue(path, p):
+    let node = p[]
+    cache.lru.remove(node)
+    cache.lru.prepend(node)
+    return node.value
+  var data = ""
+  if not readSmallFile(path, cache.maxItemSize, data):
+    return nil
+  let item = MemCacheItem(path: path, data: move(data))
+  let node = newDoublyLinkedNode(item)
+  cache.lru.prepend(node)
+  cache.map[path] = node
+  cache.size += item.data.len
+  while cache.size > cache.maxSize:
+    let tail = cache.lru.tail
+    cache.remove(tail.value.path)
+  return item
@@ -2072,13 +2072,14 @@ proc highlightMarks*(container: Container; display: var FixedGrid;
       display[y * display.width + x].format = hlformat
 
 func findCachedImage*(container: Container; image: PosBitmap;
-    offx, erry, dispw: int): CachedImage =
+    offx, erry, dispw: int; anyFrame = false): CachedImage =
   let imageId = image.bmp.imageId
   for it in container.cachedImages:
     if it.bmp.imageId == imageId and it.width == image.width and
         it.height == image.height and it.offx == offx and it.erry == erry and
-        it.dispw == dispw:
-      return it
+        it.dispw == dispw and (anyFrame or it.bmp.frame == image.bmp.frame):
+      if not anyFrame or it.loaded:
+        return it
   return nil
 
 proc handleEvent*(container: Container) =
@@ -5,6 +5,7 @@ import std/os
 import std/osproc
 import std/posix
 import std/selectors
+import std/sequtils
 import std/sets
 import std/tables
 
@@ -556,6 +557,9 @@ proc loadCachedImage(pager: Pager; container: Container; image: PosBitmap;
         container.redraw = true
         cachedImage.data = res.get
         cachedImage.loaded = true
+        # drop frames this one supersedes
+        container.cachedImages.keepIf(proc(it: CachedImage): bool =
+          it.bmp.imageId != bmp.imageId or it.bmp.frame >= bmp.frame)
       pager.loader.removeCachedItem(bmp.cacheId)
     )
   )
@@ -577,13 +581,16 @@ proc initImages(pager: Pager; container: Container) =
       erry = -min(ypx, 0) mod 6
     if dispw <= offx:
       continue
-    let cached = container.findCachedImage(image, offx, erry, dispw)
+    var cached = container.findCachedImage(image, offx, erry, dispw)
     let imageId = image.bmp.imageId
     if cached == nil:
       pager.loadCachedImage(container, image, offx, erry, dispw)
-      continue
-    if not cached.loaded:
-      continue # loading
+    if cached == nil or not cached.loaded:
+      # loading; keep displaying a previous frame of canvases meanwhile
+      cached = container.findCachedImage(image, offx, erry, dispw,
+        anyFrame = true)
+      if cached == nil:
+        continue
     let canvasImage = pager.term.loadImage(cached.data, container.process,
       imageId, image.x - container.fromx, image.y - container.fromy,
       image.width, image.height, image.x, image.y, pager.bufWidth,
@@ -1144,7 +1151,8 @@ proc applySiteconf(pager: Pager; url: var URL; charsetOverride: Charset;
     isdump: pager.config.start.headless,
     charsetOverride: charsetOverride,
     protocol: pager.config.protocol,
-    metaRefresh: pager.config.buffer.meta_refresh
+    metaRefresh: pager.config.buffer.meta_refresh,
+    maxRenderRate: pager.config.buffer.max_render_rate
   )
   loaderConfig = LoaderClientConfig(
     defaultHeaders: newHeaders(pager.config.network.default_headers),
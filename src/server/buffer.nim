@@ -1,6 +1,8 @@
-from std/strutils import split, toUpperAscii, find, AllChars
+from std/strutils import split, toUpperAscii, find, AllChars, repeat
+from std/times import initDuration, inNanoseconds
 
 import std/macros
+import std/monotimes
 import std/nativesockets
 import std/net
 import std/options
@@ -41,6 +43,7 @@ import monoucha/javascript
 import monoucha/jsregex
 import monoucha/libregexp
 import monoucha/quickjs
+import server/mappedtext
 import types/blob
 import types/cell
 import types/color
@@ -114,6 +117,21 @@ type
     cacheId: int
     outputId: int
     emptySel: Selector[int]
+    # Plain text fast path: text/plain is split into lines directly, without
+    # going through the DOM and layout.
+    plainText: bool
+    textNewline: bool # the next character starts a new line
+    textCR: bool # the last character was a carriage return
+    textWidth: int # width of the last line up to textWidthPos
+    textWidthPos: int
+    # Large plain text buffers switch to reading their lines from the cache
+    # file instead; lines is empty then.
+    mappedText: MappedText
+    noMappedText: bool # could not open the cache file
+    # Set when timers may have modified the document. The reshape is
+    # deferred to the end of the tick, and rate limited to maxRenderRate.
+    reshapePending: bool
+    lastReshape: MonoTime
 
   InterfaceOpaque = ref object
     stream: SocketStream
@@ -138,6 +156,7 @@ type
     protocol*: Table[string, ProtocolConfig]
     autofocus*: bool
     metaRefresh*: MetaRefresh
+    maxRenderRate*: int32
 
 proc getFromOpaque[T](opaque: pointer; res: var T) =
   let opaque = cast[InterfaceOpaque](opaque)
@@ -388,6 +407,18 @@ proc getImageHover(buffer: Buffer; styledNode: StyledNode): string =
     styledNode = styledNode.parent
   ""
 
+func numLines(buffer: Buffer): int =
+  if buffer.mappedText != nil:
+    return buffer.mappedText.lineCount
+  return buffer.lines.len
+
+# Note: formats are always empty for mapped text, so the link navigation
+# procs can just look at lines (which is empty in that case).
+proc getLine(buffer: Buffer; y: int): FlexibleLine =
+  if buffer.mappedText != nil:
+    return FlexibleLine(str: buffer.mappedText.getLine(y))
+  return buffer.lines[y]
+
 func getCursorStyledNode(buffer: Buffer; cursorx, cursory: int): StyledNode =
   let i = buffer.lines[cursory].findFormatN(cursorx) - 1
   if i >= 0:
@@ -407,8 +438,8 @@ func getCursorClickable(buffer: Buffer; cursorx, cursory: int): Element =
   if styledNode != nil:
     return styledNode.getClickable()
 
-func cursorBytes(buffer: Buffer; y, cc: int): int =
-  let line = buffer.lines[y].str
+proc cursorBytes(buffer: Buffer; y, cc: int): int =
+  let line = buffer.getLine(y).str
   var w = 0
   var i = 0
   while i < line.len and w < cc:
@@ -530,18 +561,18 @@ proc findNextLink*(buffer: Buffer; cursorx, cursory, n: int):
 proc findPrevParagraph*(buffer: Buffer; cursory, n: int): int {.proxy.} =
   var y = cursory
   for i in 0 ..< n:
-    while y >= 0 and buffer.lines[y].str.onlyWhitespace():
+    while y >= 0 and buffer.getLine(y).str.onlyWhitespace():
       dec y
-    while y >= 0 and not buffer.lines[y].str.onlyWhitespace():
+    while y >= 0 and not buffer.getLine(y).str.onlyWhitespace():
       dec y
   return y
 
 proc findNextParagraph*(buffer: Buffer; cursory, n: int): int {.proxy.} =
   var y = cursory
   for i in 0 ..< n:
-    while y < buffer.lines.len and buffer.lines[y].str.onlyWhitespace():
+    while y < buffer.numLines and buffer.getLine(y).str.onlyWhitespace():
       inc y
-    while y < buffer.lines.len and not buffer.lines[y].str.onlyWhitespace():
+    while y < buffer.numLines and not buffer.getLine(y).str.onlyWhitespace():
       inc y
   return y
 
@@ -581,15 +612,16 @@ proc findRevNthLink*(buffer: Buffer; i: int): tuple[x, y: int] {.proxy.} =
 
 proc findPrevMatch*(buffer: Buffer; regex: Regex; cursorx, cursory: int;
     wrap: bool, n: int): BufferMatch {.proxy.} =
-  if cursory >= buffer.lines.len: return
+  if cursory >= buffer.numLines: return
   var y = cursory
   let b = buffer.cursorBytes(y, cursorx)
-  let res = regex.exec(buffer.lines[y].str, 0, b)
+  var line = buffer.getLine(y)
+  let res = regex.exec(line.str, 0, b)
   var numfound = 0
   if res.captures.len > 0:
     let cap = res.captures[^1][0]
-    let x = buffer.lines[y].str.width(0, cap.s)
-    let str = buffer.lines[y].str.substr(cap.s, cap.e - 1)
+    let x = line.str.width(0, cap.s)
+    let str = line.str.substr(cap.s, cap.e - 1)
     inc numfound
     if numfound >= n:
       return BufferMatch(success: true, x: x, y: y, str: str)
@@ -597,14 +629,15 @@ proc findPrevMatch*(buffer: Buffer; regex: Regex; cursorx, cursory: int;
   while true:
     if y < 0:
       if wrap:
-        y = buffer.lines.high
+        y = buffer.numLines - 1
       else:
         break
-    let res = regex.exec(buffer.lines[y].str)
+    line = buffer.getLine(y)
+    let res = regex.exec(line.str)
     if res.captures.len > 0:
       let cap = res.captures[^1][0]
-      let x = buffer.lines[y].str.width(0, cap.s)
-      let str = buffer.lines[y].str.substr(cap.s, cap.e - 1)
+      let x = line.str.width(0, cap.s)
+      let str = line.str.substr(cap.s, cap.e - 1)
       inc numfound
       if numfound >= n:
         return BufferMatch(success: true, x: x, y: y, str: str)
@@ -614,30 +647,32 @@ proc findPrevMatch*(buffer: Buffer; regex: Regex; cursorx, cursory: int;
 
 proc findNextMatch*(buffer: Buffer; regex: Regex; cursorx, cursory: int;
     wrap: bool; n: int): BufferMatch {.proxy.} =
-  if cursory >= buffer.lines.len: return
+  if cursory >= buffer.numLines: return
   var y = cursory
   let b = buffer.cursorBytes(y, cursorx + 1)
-  let res = regex.exec(buffer.lines[y].str, b, buffer.lines[y].str.len)
+  var line = buffer.getLine(y)
+  let res = regex.exec(line.str, b, line.str.len)
   var numfound = 0
   if res.success and res.captures.len > 0:
     let cap = res.captures[0][0]
-    let x = buffer.lines[y].str.width(0, cap.s)
-    let str = buffer.lines[y].str.substr(cap.s, cap.e - 1)
+    let x = line.str.width(0, cap.s)
+    let str = line.str.substr(cap.s, cap.e - 1)
     inc numfound
     if numfound >= n:
       return BufferMatch(success: true, x: x, y: y, str: str)
   inc y
   while true:
-    if y > buffer.lines.high:
+    if y > buffer.numLines - 1:
       if wrap:
         y = 0
       else:
         break
-    let res = regex.exec(buffer.lines[y].str)
+    line = buffer.getLine(y)
+    let res = regex.exec(line.str)
     if res.success and res.captures.len > 0:
       let cap = res.captures[0][0]
-      let x = buffer.lines[y].str.width(0, cap.s)
-      let str = buffer.lines[y].str.substr(cap.s, cap.e - 1)
+      let x = line.str.width(0, cap.s)
+      let str = line.str.substr(cap.s, cap.e - 1)
       inc numfound
       if numfound >= n:
         return BufferMatch(success: true, x: x, y: y, str: str)
@@ -750,6 +785,8 @@ proc checkRefresh*(buffer: Buffer): CheckRefreshResult {.proxy.} =
 proc reshape(buffer: Buffer) =
   if buffer.document == nil:
     return # not parsed yet, nothing to render
+  if buffer.plainText:
+    return # lines are added as the text is read
   let uastyle = if buffer.document.mode != QUIRKS:
     buffer.uastyle
   else:
@@ -763,25 +800,117 @@ proc reshape(buffer: Buffer) =
   buffer.prevStyled = styledRoot
 
 proc maybeReshape(buffer: Buffer) =
+  buffer.reshapePending = false
   if buffer.document != nil and buffer.document.invalid:
     buffer.reshape()
     buffer.document.invalid = false
+    buffer.lastReshape = getMonoTime()
+
+# Time left until a pending reshape may run, in milliseconds; -1 if none is
+# pending.
+proc reshapeTimeout(buffer: Buffer): int =
+  if not buffer.reshapePending:
+    return -1
+  let rate = buffer.config.maxRenderRate
+  if rate <= 0:
+    return 0
+  let next = buffer.lastReshape + initDuration(milliseconds = 1000 div rate)
+  let ns = (next - getMonoTime()).inNanoseconds
+  return int(max((ns + 999_999) div 1_000_000, 0))
+
+proc plainTextElement(buffer: Buffer): HTMLElement =
+  result = buffer.document.findFirst(TAG_PLAINTEXT)
+  if result == nil:
+    const s = "<plaintext>"
+    doAssert buffer.htmlParser.parseBuffer(s) != PRES_STOP
+    result = buffer.document.findFirst(TAG_PLAINTEXT)
+
+proc addPlainTextLine(buffer: Buffer) =
+  buffer.lines.add(FlexibleLine())
+  buffer.textWidth = 0
+  buffer.textWidthPos = 0
+
+# Append decoded text to the lines of a plain text buffer. Tabs are expanded,
+# and CR and FF are displayed as spaces, like layout does with white-space:
+# pre (except for CR before LF, which is dropped).
+proc addPlainText(buffer: Buffer; data: openArray[char]) =
+  template line: untyped = buffer.lines[^1]
+  template startLine() =
+    if buffer.textNewline:
+      buffer.addPlainTextLine()
+      buffer.textNewline = false
+  var i = 0
+  while i < data.len:
+    if buffer.textCR:
+      buffer.textCR = false
+      if data[i] != '\n':
+        startLine()
+        line.str &= ' '
+    var j = i
+    while j < data.len and data[j] notin {'\n', '\r', '\t', '\f'}:
+      inc j
+    if j > i:
+      startLine()
+      let n = line.str.len
+      line.str.setLen(n + j - i)
+      copyMem(addr line.str[n], unsafeAddr data[i], j - i)
+    if j >= data.len:
+      break
+    case data[j]
+    of '\n':
+      if buffer.textNewline:
+        buffer.addPlainTextLine() # the previous line was empty
+      buffer.textNewline = true
+    of '\r':
+      buffer.textCR = true
+    of '\t':
+      startLine()
+      var w = buffer.textWidth
+      var k = buffer.textWidthPos
+      while k < line.str.len:
+        w += line.str.nextUTF8(k).width()
+      let n = (w div 8 + 1) * 8 - w
+      line.str &= ' '.repeat(n)
+      buffer.textWidth = w + n
+      buffer.textWidthPos = line.str.len
+    else: # '\f'
+      startLine()
+      line.str &= ' '
+    i = j + 1
+
+# Leave the plain text fast path, by moving the text into the DOM.
+# Used by operations that work on the DOM.
+proc materializePlainText(buffer: Buffer) =
+  if not buffer.plainText or buffer.mappedText != nil:
+    return
+  buffer.plainText = false
+  let plaintext = buffer.plainTextElement()
+  var s = ""
+  for i, line in buffer.lines:
+    if i > 0:
+      s &= '\n'
+    s &= line.str
+  if buffer.textNewline and buffer.lines.len > 0:
+    s &= '\n'
+  if s.len > 0:
+    plaintext.insert(buffer.document.createTextNode(s), nil)
+  plaintext.setInvalid()
 
 proc processData0(buffer: Buffer; data: UnsafeSlice): bool =
   if buffer.ishtml:
     if buffer.htmlParser.parseBuffer(data.toOpenArray()) == PRES_STOP:
       buffer.charsetStack = @[buffer.htmlParser.builder.charset]
       return false
+  elif buffer.mappedText != nil:
+    discard # indexed in processData
   else:
-    var plaintext = buffer.document.findFirst(TAG_PLAINTEXT)
-    if plaintext == nil:
-      const s = "<plaintext>"
-      doAssert buffer.htmlParser.parseBuffer(s) != PRES_STOP
-      plaintext = buffer.document.findFirst(TAG_PLAINTEXT)
-    if data.len > 0:
+    let plaintext = buffer.plainTextElement()
+    if buffer.plainText:
+      buffer.addPlainText(data.toOpenArray())
+    elif data.len > 0:
       let lastChild = plaintext.lastChild
       if lastChild != nil and lastChild of Text:
-        Text(lastChild).data &= data
+        Text(lastChild).appendData(data)
       else:
         plaintext.insert(buffer.document.createTextNode($data), nil)
       plaintext.setInvalid()
@@ -793,6 +922,17 @@ func canSwitch(buffer: Buffer): bool {.inline.} =
 
 const BufferSize = 16384
 
+# Limits on how much input onload parses before it returns to the event loop,
+# so that the part of the document that has already been parsed can be
+# rendered. The byte limit grows with the size of the last rendered prefix,
+# which keeps the total cost of incremental reshapes linear in the document
+# size.
+const IncrementalBytes = BufferSize * 4
+const IncrementalTime = initDuration(milliseconds = 100)
+
+# Plain text buffers larger than this are viewed through a MappedText.
+const MappedTextThreshold = 1 shl 24
+
 proc initDecoder(buffer: Buffer) =
   buffer.ctx = initTextDecoderContext(buffer.charset, demFatal, BufferSize)
 
@@ -802,6 +942,10 @@ proc switchCharset(buffer: Buffer) =
   buffer.htmlParser.restart(buffer.charset)
   buffer.document = buffer.htmlParser.builder.document
   buffer.prevStyled = nil
+  if buffer.plainText:
+    buffer.lines.setLen(0)
+    buffer.textNewline = true
+    buffer.textCR = false
 
 proc bomSniff(buffer: Buffer; iq: openArray[uint8]): int =
   if iq[0] == 0xFE and iq[1] == 0xFF:
@@ -818,7 +962,25 @@ proc bomSniff(buffer: Buffer; iq: openArray[uint8]): int =
     return 3
   return 0
 
+# Switch a large plain text buffer to a MappedText of its cache file, and
+# drop the lines it has built so far.
+proc mapPlainText(buffer: Buffer) =
+  let fd = buffer.loader.openCachedItem(buffer.cacheId)
+  if fd == -1:
+    buffer.noMappedText = true
+    return
+  let text = newMappedText(fd)
+  if not text.indexFile(buffer.bytesRead):
+    # The cache file is lagging behind; try again with the next chunk.
+    discard close(fd)
+    return
+  buffer.mappedText = text
+  buffer.lines = @[]
+
 proc processData(buffer: Buffer; iq: openArray[uint8]): bool =
+  if buffer.mappedText != nil:
+    buffer.mappedText.addData(iq)
+    return true
   var si = 0
   if buffer.needsBOMSniff:
     if iq.len >= 3: # ehm... TODO
@@ -833,6 +995,10 @@ proc processData(buffer: Buffer; iq: openArray[uint8]): bool =
   if buffer.ctx.failed:
     buffer.switchCharset()
     return false
+  if buffer.plainText and buffer.bytesRead >= MappedTextThreshold and
+      not buffer.noMappedText and buffer.cacheId != -1 and
+      buffer.charset == CHARSET_UTF_8 and not buffer.canSwitch():
+    buffer.mapPlainText()
   true
 
 proc windowChange*(buffer: Buffer; attrs: WindowAttributes) {.proxy.} =
@@ -1110,6 +1276,7 @@ proc onload(buffer: Buffer) =
   var reprocess = false
   var iq {.noinit.}: array[BufferSize, uint8]
   var n = 0
+  let deadline = getMonoTime() + IncrementalTime
   while true:
     if not reprocess:
       try:
@@ -1126,6 +1293,12 @@ proc onload(buffer: Buffer) =
           continue
       buffer.firstBufferRead = true
       reprocess = false
+      # The fd is still readable, so we are called again for the rest.
+      let unreported = buffer.bytesRead - buffer.reportedBytesRead
+      if not buffer.config.isdump and
+          (unreported >= max(IncrementalBytes, buffer.reportedBytesRead) or
+          getMonoTime() >= deadline):
+        break
     else: # EOF
       buffer.finishLoad().then(proc() =
         buffer.reshape()
@@ -1133,10 +1306,7 @@ proc onload(buffer: Buffer) =
         buffer.document.readyState = rsComplete
         if buffer.config.scripting:
           buffer.dispatchLoadEvent()
-          for ctx in buffer.window.pendingCanvasCtls:
-            ctx.ps.sclose()
-            ctx.ps = nil
-          buffer.window.pendingCanvasCtls.setLen(0)
+          buffer.window.flushCanvasFrames()
         if buffer.hasTask(bcGetTitle):
           buffer.resolveTask(bcGetTitle, buffer.document.title)
         if buffer.hasTask(bcLoad):
@@ -1631,15 +1801,16 @@ type GetLinesResult* = tuple
 
 proc getLines*(buffer: Buffer; w: Slice[int]): GetLinesResult {.proxy.} =
   var w = w
-  if w.b < 0 or w.b > buffer.lines.high:
-    w.b = buffer.lines.high
+  if w.b < 0 or w.b > buffer.numLines - 1:
+    w.b = buffer.numLines - 1
   #TODO this is horribly inefficient
   for y in w:
-    var line = SimpleFlexibleLine(str: buffer.lines[y].str)
-    for f in buffer.lines[y].formats:
+    let it = buffer.getLine(y)
+    var line = SimpleFlexibleLine(str: it.str)
+    for f in it.formats:
       line.formats.add(SimpleFormatCell(format: f.format, pos: f.pos))
     result.lines.add(line)
-  result.numLines = buffer.lines.len
+  result.numLines = buffer.numLines
   result.bgcolor = buffer.bgcolor
   if buffer.config.images:
     for image in buffer.images:
@@ -1649,6 +1820,7 @@ proc getLines*(buffer: Buffer; w: Slice[int]): GetLinesResult {.proxy.} =
 proc markURL*(buffer: Buffer; schemes: seq[string]) {.proxy.} =
   if buffer.document == nil or buffer.document.body == nil:
     return
+  buffer.materializePlainText()
   var buf = "("
   for i, scheme in schemes:
     if i > 0:
@@ -1662,8 +1834,7 @@ proc markURL*(buffer: Buffer; schemes: seq[string]) {.proxy.} =
   var stack = @[buffer.document.body]
   while stack.len > 0:
     let element = stack.pop()
-    for i in countdown(element.childList.high, 0):
-      let node = element.childList[i]
+    for node in element.childList_rev:
       if node of Text:
         let text = Text(node)
         var res = regex.exec(text.data)
@@ -1779,6 +1950,9 @@ proc readCommand(buffer: Buffer) =
   var packetid: int
   r.sread(cmd)
   r.sread(packetid)
+  if buffer.reshapePending:
+    # the pager must not see stale lines
+    buffer.maybeReshape()
   bufferDispatcher(ProxyFunctions, buffer, cmd, packetid, r)
 
 proc handleRead(buffer: Buffer; fd: int): bool =
@@ -1800,6 +1974,10 @@ proc handleRead(buffer: Buffer; fd: int): bool =
     buffer.loader.onRead(fd)
     if buffer.config.scripting:
       buffer.window.runJSJobs()
+      buffer.window.flushCanvasFrames()
+      if buffer.window.newCanvasFrames:
+        buffer.window.newCanvasFrames = false
+        buffer.reshapePending = true
   elif fd in buffer.loader.unregistered:
     discard # ignore
   else:
@@ -1829,7 +2007,18 @@ proc runBuffer(buffer: Buffer) =
   var alive = true
   var keys: array[64, ReadyKey]
   while alive:
-    let count = buffer.selector.selectInto(-1, keys)
+    # wake up for whichever is due first: a held-back canvas frame or a
+    # pending reshape
+    var timeout = -1
+    if buffer.config.scripting:
+      timeout = buffer.window.storePendingCanvasFrames()
+      if buffer.window.newCanvasFrames:
+        buffer.window.newCanvasFrames = false
+        buffer.reshapePending = true
+    let reshapeMs = buffer.reshapeTimeout()
+    if timeout == -1 or reshapeMs != -1 and reshapeMs < timeout:
+      timeout = reshapeMs
+    let count = buffer.selector.selectInto(timeout, keys)
     for event in keys.toOpenArray(0, count - 1):
       if Read in event.events:
         if not buffer.handleRead(event.fd):
@@ -1843,8 +2032,12 @@ proc runBuffer(buffer: Buffer) =
         let r = buffer.window.timeouts.runTimeoutFd(event.fd)
         assert r
         buffer.window.runJSJobs()
-        buffer.maybeReshape()
+        buffer.window.flushCanvasFrames()
+        buffer.reshapePending = true
     buffer.loader.unregistered.setLen(0)
+    # Reshape at most once for all the timers of this tick.
+    if alive and buffer.reshapePending and buffer.reshapeTimeout() == 0:
+      buffer.maybeReshape()
 
 proc cleanup(buffer: Buffer) =
   buffer.pstream.sclose()
@@ -1867,6 +2060,8 @@ proc launchBuffer*(config: BufferConfig; url: URL; attrs: WindowAttributes;
     config: config,
     estream: newDynFileStream(stderr),
     ishtml: ishtml,
+    plainText: not ishtml,
+    textNewline: true,
     loader: loader,
     needsBOMSniff: config.charsetOverride == CHARSET_UNKNOWN,
     pstream: pstream,
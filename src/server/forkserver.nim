@@ -47,7 +47,10 @@ proc loadConfig*(forkserver: ForkServer; config: Config): int =
       w3mCGICompat: config.external.w3m_cgi_compat,
       cgiDir: seq[string](config.external.cgi_dir),
       tmpdir: config.external.tmpdir,
-      sockdir: config.external.sockdir
+      sockdir: config.external.sockdir,
+      cacheDir: config.network.cache_dir,
+      cacheSize: int(config.network.cache_size) * 1024 * 1024,
+      memoryCacheSize: int(config.network.memory_cache_size) * 1024
     ))
   var r = forkserver.istream.initPacketReader()
   var process: int
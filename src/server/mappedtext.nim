@@ -0,0 +1,163 @@
+# Viewer for plain text files too large to keep in memory as lines.
+#
+# The text is read from the buffer's cache file through a memory mapping.
+# Only the start offset of every LineIndexStride-th line is stored, and lines
+# are converted to their display form (tabs expanded, CR and FF as spaces,
+# invalid UTF-8 replaced) only when they are requested.
+#
+# The index is built from the same bytes the buffer reads from its input
+# stream, so the mapped pages are only touched for lines that are actually
+# displayed or searched.
+
+import std/posix
+
+import utils/strwidth
+import utils/twtuni
+
+const LineIndexStride = 64
+
+type MappedText* = ref object
+  fd: cint
+  p: ptr UncheckedArray[char]
+  mapLen: int
+  size: int # number of bytes indexed
+  newlines: int # number of newlines in the indexed bytes
+  lastNewline: bool # the last indexed byte was a newline
+  starts: seq[int] # start offsets of every LineIndexStride-th line
+  fileLen: int # file size as of the last lseek
+  # Start offset of line cacheY, so that reading lines in order does not
+  # rescan from the last indexed line every time. -1 if none.
+  cacheY: int
+  cacheStart: int
+
+proc newMappedText*(fd: cint): MappedText =
+  return MappedText(fd: fd, lastNewline: true, starts: @[0], cacheY: -1)
+
+func lineCount*(text: MappedText): int =
+  if text.lastNewline:
+    return text.newlines
+  return text.newlines + 1
+
+# Index bytes that follow the ones already indexed.
+proc addData*(text: MappedText; data: openArray[uint8]) =
+  for i, c in data:
+    if c == uint8('\n'):
+      inc text.newlines
+      if text.newlines mod LineIndexStride == 0:
+        text.starts.add(text.size + i + 1)
+  if data.len > 0:
+    text.lastNewline = data[^1] == uint8('\n')
+    text.size += data.len
+
+# Size of the cache file, or at least len if the file has grown that large.
+# It may lag behind the data read from the input stream, since the loader
+# writes the file after the stream; the file is only asked again while it
+# is shorter than len.
+proc fileSize(text: MappedText; len: int): int =
+  if text.fileLen < len:
+    let size = lseek(text.fd, 0, SEEK_END)
+    if size > 0:
+      text.fileLen = int(size)
+  return text.fileLen
+
+# Make sure that the first len bytes of the file are mapped.
+# Pages past the end of the file may be mapped, but must never be touched.
+proc ensureMapped(text: MappedText; len: int): bool =
+  if len <= text.mapLen:
+    return true
+  let newLen = max(len, text.mapLen * 2)
+  let p = mmap(nil, newLen, PROT_READ, MAP_SHARED, text.fd, 0)
+  if p == MAP_FAILED:
+    return false
+  if text.p != nil:
+    discard munmap(text.p, text.mapLen)
+  text.p = cast[ptr UncheckedArray[char]](p)
+  text.mapLen = newLen
+  return true
+
+# Index the first len bytes of the file, for data that had been read from the
+# input stream before the buffer switched to this mode. Returns false if the
+# file is shorter than that yet.
+proc indexFile*(text: MappedText; len: int): bool =
+  if text.fileSize(len) < len or not text.ensureMapped(len):
+    return false
+  if text.size == 0 and len >= 3 and text.p[0] == '\xEF' and
+      text.p[1] == '\xBB' and text.p[2] == '\xBF':
+    # skip the BOM
+    text.size = 3
+    text.starts[0] = 3
+  let p = cast[ptr UncheckedArray[uint8]](text.p)
+  text.addData(p.toOpenArray(text.size, len - 1))
+  return true
+
+proc addDisplayText(res: var string; s: openArray[char]) =
+  var w = 0
+  var i = 0
+  while i < s.len:
+    let c = s[i]
+    case c
+    of '\t':
+      let n = (w div 8 + 1) * 8 - w
+      for j in 0 ..< n:
+        res &= ' '
+      w += n
+      inc i
+    of '\r', '\f':
+      if c == '\f' or i < s.high:
+        res &= ' '
+        inc w
+      inc i
+    of '\0'..'\x08', '\n', '\v', '\x0E'..'\x7F':
+      res &= c
+      w += uint32(c).width()
+      inc i
+    else:
+      let b = uint8(c)
+      let n = if b shr 5 == 0b110 and b >= 0xC2: 2
+      elif b shr 4 == 0b1110: 3
+      elif b shr 3 == 0b11110 and b <= 0xF4: 4
+      else: 0
+      var valid = n > 0 and i + n <= s.len
+      if valid:
+        for j in i + 1 ..< i + n:
+          if uint8(s[j]) shr 6 != 0b10:
+            valid = false
+            break
+      if valid:
+        let pi = i
+        w += s.nextUTF8(i).width()
+        for j in pi ..< i:
+          res &= s[j]
+      else:
+        res.addUTF8(0xFFFD)
+        w += 1
+        inc i
+
+# Display form of line y.
+proc getLine*(text: MappedText; y: int): string =
+  result = ""
+  var i = text.starts[y div LineIndexStride]
+  var k = y - y mod LineIndexStride
+  if text.cacheY in k .. y:
+    i = text.cacheStart
+    k = text.cacheY
+  let size = min(text.size, text.fileSize(text.size))
+  if i >= size or not text.ensureMapped(size):
+    return
+  while k < y:
+    while i < size and text.p[i] != '\n':
+      inc i
+    inc i
+    if i >= size:
+      return
+    inc k
+  var e = i
+  while e < size and text.p[e] != '\n':
+    inc e
+  if e < size:
+    text.cacheY = y + 1
+    text.cacheStart = e + 1
+  else:
+    text.cacheY = y
+    text.cacheStart = i
+  result.addDisplayText(text.p.toOpenArray(i, e - 1))
@@ -0,0 +1,43 @@
+# clearRect test.
+#
+# Clearing must replace the pixels of the rectangle with transparent black
+# (blending a transparent color would leave them untouched), and whatever
+# is drawn over the cleared area afterwards must end up as if it had been
+# drawn on a fresh bitmap.
+
+import img/bitmap
+import img/painter
+import types/color
+
+proc check(bmp: Bitmap; x1, y1, x2, y2: int; inside, outside: RGBAColorBE) =
+  for y in 0 ..< bmp.height:
+    for x in 0 ..< bmp.width:
+      let c = bmp.getpx(x, y)
+      if x >= x1 and x < x2 and y >= y1 and y < y2:
+        doAssert c == inside, $x & "," & $y
+      else:
+        doAssert c == outside, $x & "," & $y
+
+proc main() =
+  let red = rgba(255, 0, 0, 255)
+  let blue = rgba(0, 0, 255, 128)
+  let bmp = newBitmap(16, 16)
+  bmp.fillRect(0, 0, 16, 16, red)
+  bmp.clearRect(4, 4, 12, 12)
+  bmp.check(4, 4, 12, 12, rgba_be(0, 0, 0, 0), rgb_be(255, 0, 0))
+  # out of bounds parts are clipped
+  bmp.clearRect(-8, -8, 4, 4)
+  bmp.clearRect(12, 12, 100, 100)
+  doAssert bmp.getpx(0, 0) == rgba_be(0, 0, 0, 0)
+  doAssert bmp.getpx(15, 15) == rgba_be(0, 0, 0, 0)
+  doAssert bmp.getpx(15, 0) == rgb_be(255, 0, 0)
+  # redraw the cleared area
+  bmp.fillRect(0, 0, 16, 16, red)
+  bmp.clearRect(4, 4, 12, 12)
+  bmp.fillRect(4, 4, 12, 12, blue)
+  let fresh = newBitmap(8, 8)
+  fresh.fillRect(0, 0, 8, 8, blue)
+  bmp.check(4, 4, 12, 12, fresh.getpx(0, 0), rgb_be(255, 0, 0))
+  echo "Success"
+
+main()
@@ -0,0 +1,124 @@
+/* Check the SIMD row kernels of src/img/span.c against the scalar ones.
+ *
+ * The kernels are static, so the file is included directly. Destinations
+ * mix opaque, transparent and translucent pixels, and lengths are chosen
+ * so that the vector loops end on every possible remainder. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../src/img/span.c"
+
+#define MAXLEN 67
+
+static uint32_t rand_px(void)
+{
+	uint32_t c = (uint32_t)rand() ^ (uint32_t)rand() << 16;
+
+	switch (rand() % 4) {
+	case 0:
+		return c | 0xFFu << ASHIFT;
+	case 1:
+		return c & ~(0xFFu << ASHIFT);
+	default:
+		return c;
+	}
+}
+
+static int failed = 0;
+
+static void check(const char *name, const uint32_t *a, const uint32_t *b,
+	size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (a[i] != b[i]) {
+			fprintf(stderr, "%s: pixel %zu of %zu: %08x != %08x\n",
+				name, i, n, (unsigned)a[i], (unsigned)b[i]);
+			failed = 1;
+			return;
+		}
+	}
+}
+
+int main(void)
+{
+	uint32_t src[MAXLEN], ref[MAXLEN], dst[MAXLEN];
+	int iter;
+
+	srand(1);
+	for (iter = 0; iter < 10000; iter++) {
+		size_t n = (size_t)(iter % (MAXLEN + 1));
+		uint32_t c = rand_px();
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			ref[i] = rand_px();
+			src[i] = rand_px();
+		}
+#ifdef CHA_SPAN_X86
+		int impl = get_span_impl();
+
+		memcpy(dst, ref, n * sizeof(uint32_t));
+		fill_scalar(ref, c, n);
+		fill_sse2(dst, c, n);
+		check("fill_sse2", ref, dst, n);
+		if (impl == SPAN_AVX2) {
+			fill_avx2(dst, 0, n);
+			fill_avx2(dst, c, n);
+			check("fill_avx2", ref, dst, n);
+		}
+		for (i = 0; i < n; i++)
+			ref[i] = rand_px();
+		memcpy(dst, ref, n * sizeof(uint32_t));
+		blend_color_scalar(ref, c, n);
+		blend_color_sse2(dst, c, n);
+		check("blend_color_sse2", ref, dst, n);
+		if (impl == SPAN_AVX2) {
+			uint32_t tmp[MAXLEN];
+
+			memcpy(tmp, src, n * sizeof(uint32_t));
+			blend_color_scalar(tmp, c, n);
+			memcpy(dst, src, n * sizeof(uint32_t));
+			blend_color_avx2(dst, c, n);
+			check("blend_color_avx2", tmp, dst, n);
+		}
+		for (i = 0; i < n; i++)
+			ref[i] = rand_px();
+		memcpy(dst, ref, n * sizeof(uint32_t));
+		{
+			uint32_t tmp[MAXLEN];
+
+			memcpy(tmp, ref, n * sizeof(uint32_t));
+			blend_scalar(ref, src, n);
+			blend_sse2(dst, src, n);
+			check("blend_sse2", ref, dst, n);
+			if (impl == SPAN_AVX2) {
+				memcpy(dst, tmp, n * sizeof(uint32_t));
+				blend_avx2(dst, src, n);
+				check("blend_avx2", ref, dst, n);
+			}
+		}
+#endif
+		/* public entry points, whichever implementation they pick */
+		for (i = 0; i < n; i++)
+			ref[i] = dst[i] = rand_px();
+		blend_scalar(ref, src, n);
+		cha_span_blend(dst, src, n);
+		check("cha_span_blend", ref, dst, n);
+		for (i = 0; i < n; i++)
+			ref[i] = dst[i] = rand_px();
+		if (ALPHA(c) != 0)
+			blend_color_scalar(ref, c, n);
+		cha_span_blend_color(dst, c, n);
+		check("cha_span_blend_color", ref, dst, n);
+		fill_scalar(ref, c, n);
+		cha_span_fill(dst, c, n);
+		check("cha_span_fill", ref, dst, n);
+	}
+	if (failed)
+		return 1;
+	printf("Success\n");
+	return 0;
+}
@@ -0,0 +1,216 @@
+# Layout benchmark.
+#
+# Runs the HTML parser, the cascade, layout and rendering headlessly on the
+# layout test cases and on a few large generated pages, or only on the files
+# given on the command line.
+#
+# For each page and phase, one line of JSON is printed with the best wall
+# time out of n runs (-n, default 5) and the growth of the GC heap. At the
+# end, peak RSS of the whole run is printed. Compare two commits with e.g.
+#
+#   make bench_layout > before.json
+#   (switch branches)
+#   make bench_layout > after.json
+#   jq -s 'group_by(.page, .phase)' before.json after.json
+#
+# Note: this runs with scripting and images disabled, and without a loader,
+# so external resources are never fetched.
+
+import std/algorithm
+import std/json
+import std/monotimes
+import std/options
+import std/os
+import std/posix
+import std/strutils
+import std/times
+
+import chagashi/charset
+import chame/tags
+import css/cascade
+import css/sheet
+import css/stylednode
+import html/catom
+import html/chadombuilder
+import html/dom
+import html/env
+import layout/box
+import layout/engine
+import layout/renderdocument
+import types/color
+import types/url
+import types/winattrs
+
+type
+  Phase = enum
+    phParse = "parse"
+    phCascade = "cascade"
+    phLayout = "layout"
+    phRender = "render"
+
+  PhaseResult = object
+    best: Duration
+    heap: int
+
+  BenchContext = object
+    runs: int
+    factory: CAtomFactory
+    attrs: WindowAttributes
+    uastyle: CSSStylesheet
+    quirkstyle: CSSStylesheet
+    userstyle: CSSStylesheet
+
+proc newBenchContext(runs: int): BenchContext =
+  const css = staticRead"res/ua.css"
+  const quirk = css & staticRead"res/quirk.css"
+  let factory = newCAtomFactory()
+  # same as test/layout/config.toml
+  let attrs = WindowAttributes(
+    width: 80,
+    height: 24,
+    ppc: 9,
+    ppl: 18,
+    widthPx: 80 * 9,
+    heightPx: 24 * 18
+  )
+  return BenchContext(
+    runs: runs,
+    factory: factory,
+    attrs: attrs,
+    uastyle: css.parseStylesheet(factory),
+    quirkstyle: quirk.parseStylesheet(factory),
+    userstyle: "".parseStylesheet(factory)
+  )
+
+proc parseDocument(ctx: BenchContext; s: string): Document =
+  let url = parseURL("file:///bench.html").get
+  let window = newWindow(
+    scripting = false,
+    images = false,
+    styling = true,
+    selector = nil,
+    attrs = ctx.attrs,
+    factory = ctx.factory,
+    loader = nil,
+    url = url
+  )
+  let wrapper = newHTML5ParserWrapper(window, url, ctx.factory, ccCertain,
+    CHARSET_UTF_8)
+  discard wrapper.parseBuffer(s.toOpenArray(0, s.high))
+  wrapper.finish()
+  return wrapper.builder.document
+
+template measure(res: var array[Phase, PhaseResult]; phase: Phase;
+    body: untyped) =
+  let heap0 = getOccupiedMem()
+  let t0 = getMonoTime()
+  body
+  let t = getMonoTime() - t0
+  if res[phase].best == Duration() or t < res[phase].best:
+    res[phase].best = t
+  res[phase].heap = max(res[phase].heap, getOccupiedMem() - heap0)
+
+proc bench(ctx: var BenchContext; name, s: string) =
+  var res: array[Phase, PhaseResult]
+  for i in 0 ..< ctx.runs:
+    var document: Document
+    var styledRoot: StyledNode
+    var rootBox: BlockBox
+    var grid: FlexibleGrid
+    var bgcolor = defaultColor
+    var images: seq[PosBitmap] = @[]
+    res.measure phParse:
+      document = ctx.parseDocument(s)
+    let uastyle = if document.mode != QUIRKS:
+      ctx.uastyle
+    else:
+      ctx.quirkstyle
+    res.measure phCascade:
+      styledRoot = document.applyStylesheets(uastyle, ctx.userstyle, nil)
+    if styledRoot == nil:
+      break
+    res.measure phLayout:
+      rootBox = styledRoot.layout(addr ctx.attrs)
+    res.measure phRender:
+      grid.renderDocument(bgcolor, rootBox, addr ctx.attrs, images)
+    GC_fullCollect()
+  for phase, it in res:
+    let us = it.best.inMicroseconds
+    echo "{\"page\":", escapeJson(name), ",\"phase\":\"", $phase, "\",\"ms\":",
+      formatFloat(float64(us) / 1000, ffDecimal, 3), ",\"heap\":", it.heap,
+      "}"
+
+# Generated pages
+
+proc deepNesting(): string =
+  result = "<!DOCTYPE html><body>"
+  for i in 0 ..< 500:
+    result &= "<div style='margin-left: 1px'>level " & $i
+  for i in 0 ..< 500:
+    result &= "</div>"
+
+proc hugeTable(): string =
+  result = "<!DOCTYPE html><table border=1>"
+  for i in 0 ..< 300:
+    result &= "<tr>"
+    for j in 0 ..< 10:
+      result &= "<td>cell " & $i & "," & $j & "</td>"
+    result &= "</tr>"
+  result &= "</table>"
+
+proc nestedTables(): string =
+  result = "<!DOCTYPE html>"
+  for i in 0 ..< 8:
+    result &= "<table><tr><td>left " & $i & "</td><td>"
+  result &= "innermost"
+  for i in 0 ..< 8:
+    result &= "</td></tr></table>"
+
+proc flatText(): string =
+  const para = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, " &
+    "sed do eiusmod tempor incididunt ut labore et dolore magna aliqua."
+  result = "<!DOCTYPE html><body>"
+  for i in 0 ..< 10000:
+    result &= "<p>" & para & "</p>"
+
+proc manyFloats(): string =
+  result = "<!DOCTYPE html><body>"
+  for i in 0 ..< 1000:
+    let side = if i mod 2 == 0: "left" else: "right"
+    result &= "<div style='float: " & side & "; width: " & $(i mod 20 + 5) &
+      "ch'>float " & $i & "</div>"
+    if i mod 10 == 0:
+      result &= "<p>Some text flowing around the floats.</p>"
+
+proc main() =
+  var runs = 5
+  var files: seq[string] = @[]
+  var i = 1
+  while i <= paramCount():
+    let arg = paramStr(i)
+    if arg == "-n" and i < paramCount():
+      inc i
+      runs = parseInt(paramStr(i))
+    else:
+      files.add(arg)
+    inc i
+  var ctx = newBenchContext(runs)
+  let generated = files.len == 0
+  if generated:
+    for file in walkFiles("*.html"):
+      files.add(file)
+    files.sort()
+  for file in files:
+    ctx.bench(file.extractFilename(), readFile(file))
+  if generated:
+    ctx.bench("gen:deep-nesting", deepNesting())
+    ctx.bench("gen:huge-table", hugeTable())
+    ctx.bench("gen:nested-tables", nestedTables())
+    ctx.bench("gen:flat-text", flatText())
+    ctx.bench("gen:many-floats", manyFloats())
+  var ru: Rusage
+  discard getrusage(RUSAGE_SELF, addr ru)
+  # ru_maxrss is in kilobytes on Linux and the BSDs
+  echo "{\"page\":\"total\",\"phase\":\"peak-rss\",\"kb\":", ru.ru_maxrss, "}"
+
+main()
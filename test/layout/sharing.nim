@@ -0,0 +1,72 @@
+# Style sharing test.
+#
+# Siblings that only differ in their contents must get the very same
+# computed values from the cascade under the default UA sheet; if any rule
+# of the sheet makes them unshareable, the sharing cache is never used.
+
+import std/options
+
+import chagashi/charset
+import chame/tags
+import css/cascade
+import css/sheet
+import css/stylednode
+import html/catom
+import html/chadombuilder
+import html/dom
+import html/env
+import types/url
+import types/winattrs
+
+proc parseDocument(factory: CAtomFactory; s: string): Document =
+  let url = parseURL("file:///sharing.html").get
+  let window = newWindow(
+    scripting = false,
+    images = false,
+    styling = true,
+    selector = nil,
+    attrs = WindowAttributes(width: 80, height: 24, ppc: 9, ppl: 18,
+      widthPx: 80 * 9, heightPx: 24 * 18),
+    factory = factory,
+    loader = nil,
+    url = url
+  )
+  let wrapper = newHTML5ParserWrapper(window, url, factory, ccCertain,
+    CHARSET_UTF_8)
+  discard wrapper.parseBuffer(s.toOpenArray(0, s.high))
+  wrapper.finish()
+  return wrapper.builder.document
+
+proc collect(styledNode: StyledNode; tag: CAtom; res: var seq[StyledNode]) =
+  if styledNode.t != stElement:
+    return
+  if styledNode.pseudo == peNone and styledNode.node of Element and
+      Element(styledNode.node).localName == tag:
+    res.add(styledNode)
+  for child in styledNode.children:
+    child.collect(tag, res)
+
+proc check(factory: CAtomFactory; root: StyledNode; tag: TagType) =
+  var res: seq[StyledNode] = @[]
+  root.collect(factory.toAtom(tag), res)
+  doAssert res.len > 1, $tag
+  for it in res:
+    doAssert it.computed == res[0].computed, $tag & " not shared"
+
+proc main() =
+  const css = staticRead"res/ua.css"
+  let factory = newCAtomFactory()
+  let uastyle = css.parseStylesheet(factory)
+  let userstyle = "".parseStylesheet(factory)
+  let document = factory.parseDocument("""<!DOCTYPE html>
+<ul><li>one<li>two<li>three</ul>
+<p>first<p>second<p>third
+<table><tr><td>a<td>b<td>c</table>
+""")
+  let root = document.applyStylesheets(uastyle, userstyle, nil)
+  factory.check(root, TAG_LI)
+  factory.check(root, TAG_P)
+  factory.check(root, TAG_TD)
+  echo "Success"
+
+main()